@@ -0,0 +1,163 @@
+/*
+ * Account store benchmark.
+ *
+ * Compares the chunked account store with the old packed layout
+ * (account number, balance and rwlock side by side) on a full scan, as
+ * done when saving the details file, and on threads that keep updating
+ * accounts under their write locks. Also times a bulk change of every
+ * account, one acc_add() at a time against acc_bulk().
+ *
+ * The updates run twice: on neighbouring accounts, and on accounts a
+ * chunk apart. In a chunk, 8 balances share a cache line and 16
+ * versions do, so writers of neighbouring accounts bounce those lines
+ * between them. That is the price of keeping balances contiguous for
+ * scans and bulk changes, and the gap between the two runs shows it.
+ */
+
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "account.h"
+
+struct PackedAccount { // the layout accounts used to have
+    int accountN;
+    int balance;
+    pthread_rwlock_t lock;
+};
+
+struct PackedAccount *packed;
+int numaccounts = 200000;
+int rounds = 20;
+int numthreads = 4;
+long updates = 2000000;
+int spread = 1; // distance between the accounts of the updating threads
+char *buf;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+void *packed_updater(void *arg) {
+    struct PackedAccount *a = &packed[(long)arg*spread];
+    long i;
+    for (i = 0; i < updates; i++) {
+        pthread_rwlock_wrlock(&a->lock);
+        a->balance++;
+        pthread_rwlock_unlock(&a->lock);
+    }
+    return NULL;
+}
+
+void *chunked_updater(void *arg) {
+    int idx = (long)arg*spread;
+    long i;
+    for (i = 0; i < updates; i++) {
+        pthread_rwlock_wrlock(&ACCLOCK(idx).lock);
+        acc_add(idx,1);
+        pthread_rwlock_unlock(&ACCLOCK(idx).lock);
+    }
+    return NULL;
+}
+
+double run_threads(void *(*fn)(void *)) {
+    pthread_t t[64];
+    long i;
+    double start = now();
+    for (i = 0; i < numthreads; i++) pthread_create(&t[i],NULL,fn,(void *)i);
+    for (i = 0; i < numthreads; i++) pthread_join(t[i],NULL);
+    return now()-start;
+}
+
+int main(int argc,char **argv) {
+    int opt;
+    while ((opt = getopt(argc,argv,"a:r:t:u:")) != -1) {
+        switch (opt) {
+        case 'a': numaccounts = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 't': numthreads = atoi(optarg); break;
+        case 'u': updates = atol(optarg); break;
+        default: printf("Usage: %s [-a accounts] [-r scanrounds] [-t threads] [-u updates]\n",argv[0]);
+            return -1;
+        }
+    }
+    if (numthreads > 64 || numaccounts < numthreads*CHUNK) {
+        printf("Bad parameters\n");
+        return -1;
+    }
+
+    packed = malloc(numaccounts*sizeof(struct PackedAccount));
+    buf = malloc((size_t)numaccounts*SNAPLINE);
+    if (packed == NULL || buf == NULL) return -1;
+    int i,r;
+    for (i = 0; i < numaccounts; i++) {
+        packed[i].accountN = i;
+        packed[i].balance = i;
+        pthread_rwlock_init(&packed[i].lock,NULL);
+        acc_add(acc_get(i),i);
+    }
+
+    double start = now();
+    long total = 0;
+    for (r = 0; r < rounds; r++) { // scan: count balances above a limit, as a bulk operation would
+        for (i = 0; i < numaccounts; i++) total += packed[i].balance > r*1000;
+    }
+    double tp = now()-start;
+    start = now();
+    long long total2 = 0;
+    for (r = 0; r < rounds; r++) {
+        int c;
+        for (c = 0; c*CHUNK < numaccounts; c++) {
+            int n = numaccounts-c*CHUNK < CHUNK ? numaccounts-c*CHUNK : CHUNK;
+            for (i = 0; i < n; i++) total2 += chunks[c]->balance[i] > r*1000;
+        }
+    }
+    double tc = now()-start;
+    printf("scan:    packed %8.1f M accounts/s, chunked %8.1f M accounts/s (counts %ld %lld)\n",
+        numaccounts*(double)rounds/tp/1e6,numaccounts*(double)rounds/tc/1e6,total,total2);
+
+    start = now();
+    int len = 0;
+    for (r = 0; r < rounds; r++) {
+        len = 0;
+        for (i = 0; i < numaccounts; i++) len += snprintf(buf+len,SNAPLINE,"%d - %d\n",packed[i].accountN,packed[i].balance);
+    }
+    tp = now()-start;
+    start = now();
+    for (r = 0; r < rounds; r++) len = acc_format(buf,0,numaccounts);
+    tc = now()-start;
+    printf("save:    packed %8.1f M accounts/s, chunked %8.1f M accounts/s\n",
+        numaccounts*(double)rounds/tp/1e6,numaccounts*(double)rounds/tc/1e6);
+
+    start = now();
+    int skipped;
+    for (r = 0; r < rounds; r++) { // bulk: flat change of every account
+        for (i = 0; i < numaccounts; i++) acc_add(i,1);
+    }
+    tp = now()-start;
+    start = now();
+    for (r = 0; r < rounds; r++) acc_bulk(numaccounts,0,numaccounts,0,1,&skipped);
+    tc = now()-start;
+    start = now();
+    for (r = 0; r < rounds; r++) acc_bulk(numaccounts,0,numaccounts,1,1,&skipped);
+    double tr = now()-start;
+    printf("bulk:    one by one %8.1f M accounts/s, flat %8.1f M accounts/s, rate %8.1f M accounts/s\n",
+        numaccounts*(double)rounds/tp/1e6,numaccounts*(double)rounds/tc/1e6,numaccounts*(double)rounds/tr/1e6);
+
+    for (spread = 1; spread <= CHUNK; spread *= CHUNK) { // neighbours share balance and version lines, a chunk apart nothing does
+        tp = run_threads(packed_updater);
+        tc = run_threads(chunked_updater);
+        printf("updates: packed %8.1f M/s, chunked %8.1f M/s (%d threads on %s accounts)\n",
+            numthreads*(double)updates/tp/1e6,numthreads*(double)updates/tc/1e6,numthreads,spread == 1 ? "neighbouring" : "spread-out");
+    }
+
+    acc_free();
+    free(packed);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,390 @@
+/**
+ * Account store.
+ * Accounts live in chunks that never move once allocated, so a slot
+ * index stays valid while other threads add accounts. Balances are
+ * 64-bit and kept apart from the account numbers and lock state; a hash
+ * index maps account numbers to slots without locking on the read side.
+ * The chunk table and the index are replaced by copies twice as big as
+ * accounts are added. Readers may still be on an old copy, which holds
+ * every account added before the swap, so old copies are only freed
+ * together with the store.
+ */
+
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "account.h"
+
+#define RETIRED 64 // room for replaced tables and indexes, far more than doubling up to the int range takes
+
+struct AccIndex {
+    unsigned mask; // slots - 1
+    int slot[]; // slot + 1 of every account, 0 for an empty index entry
+};
+
+struct AccChunk **chunks = NULL; // chunks allocated so far, the rest are NULL
+int num_accounts = 0; // slots in use, published after the slot is ready
+static int numchunks = 0; // room in chunks
+static struct AccIndex *accindex = NULL;
+static void *retired[RETIRED]; // replaced tables and indexes, lookups may still be reading them
+static int numretired = 0;
+static pthread_mutex_t addM = PTHREAD_MUTEX_INITIALIZER; // serializes adding accounts
+
+static unsigned hash(int accN,unsigned mask) {
+    return ((unsigned)accN * 2654435761u) & mask;
+}
+
+/**
+ * Find an account.
+ * \param accN Account number.
+ * \return Slot of the account, -1 if there is no such account. */
+int acc_find(int accN) {
+    struct AccIndex *x = __atomic_load_n(&accindex,__ATOMIC_ACQUIRE);
+    if (x == NULL) return -1;
+    unsigned h = hash(accN,x->mask);
+    int e;
+    while ((e = __atomic_load_n(&x->slot[h],__ATOMIC_ACQUIRE)) != 0) {
+        if (ACCNUMBER(e-1) == accN) return e-1;
+        h = (h+1) & x->mask;
+    }
+    return -1;
+}
+
+static void place(struct AccIndex *x,int idx) { // with addM held
+    unsigned h = hash(ACCNUMBER(idx),x->mask);
+    while (x->slot[h] != 0) h = (h+1) & x->mask;
+    __atomic_store_n(&x->slot[h],idx+1,__ATOMIC_RELEASE); // the slot is ready, make it findable
+}
+
+/**
+ * Make room for one more account, with addM held. A full chunk table or
+ * index is copied into one twice as big, which then takes its place.
+ * \return 0 on success, -1 out of memory. */
+static int grow(void) {
+    int n = num_accounts,i;
+    if (n == INT_MAX || numretired > RETIRED-2) return -1;
+    if (n/CHUNK >= numchunks) {
+        int size = numchunks ? 2*numchunks : FIRSTCHUNKS;
+        struct AccChunk **t = calloc(size,sizeof(struct AccChunk *));
+        if (t == NULL) return -1;
+        if (chunks != NULL) {
+            memcpy(t,chunks,numchunks*sizeof(struct AccChunk *));
+            retired[numretired++] = chunks;
+        }
+        __atomic_store_n(&chunks,t,__ATOMIC_RELEASE);
+        numchunks = size;
+    }
+    if (accindex == NULL || (unsigned)n+1 > (accindex->mask+1)/2) {
+        unsigned size = accindex ? 2*(accindex->mask+1) : FIRSTINDEX;
+        struct AccIndex *x = size != 0 ? calloc(1,sizeof(struct AccIndex)+(size_t)size*sizeof(int)) : NULL;
+        if (x == NULL) return -1;
+        x->mask = size-1;
+        for (i = 0; i < n; i++) place(x,i);
+        if (accindex != NULL) retired[numretired++] = accindex;
+        __atomic_store_n(&accindex,x,__ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Find an account, adding it with a zero balance if it doesn't exist.
+ * \param accN Account number.
+ * \return Slot of the account, -1 if there is no memory for it. */
+int acc_get(int accN) {
+    int idx = acc_find(accN);
+    if (idx >= 0) return idx;
+    pthread_mutex_lock(&addM);
+    idx = acc_find(accN); // someone may have added it meanwhile
+    if (idx < 0 && grow() == 0) {
+        idx = num_accounts;
+        if (chunks[idx/CHUNK] == NULL) {
+            struct AccChunk *c = aligned_alloc(64,sizeof(struct AccChunk));
+            if (c == NULL) {
+                pthread_mutex_unlock(&addM);
+                return -1;
+            }
+            memset(c,0,sizeof(struct AccChunk));
+            chunks[idx/CHUNK] = c;
+        }
+        ACCNUMBER(idx) = accN;
+        ACCBALANCE(idx) = 0;
+        ACCHELD(idx) = 0;
+        ACCVERSION(idx) = 0;
+        ACCLOCK(idx).contended = 0;
+        ACCLOCK(idx).comb = -1;
+        pthread_rwlock_init(&ACCLOCK(idx).lock,NULL);
+        place(accindex,idx);
+        __atomic_store_n(&num_accounts,idx+1,__ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&addM);
+    return idx;
+}
+
+/**
+ * Load accounts from a details file ("account - balance" per line).
+ * \param path File to read.
+ * \return Number of accounts loaded, -1 if the file couldn't be opened. */
+int acc_load(const char *path) {
+    FILE *file = fopen(path,"r");
+    if (file == NULL) return -1;
+    int acc,n = 0;
+    long long amount;
+    while (fscanf(file,"%d - %lld\n",&acc,&amount) == 2) {
+        int idx = acc_get(acc);
+        if (idx < 0) break;
+        ACCBALANCE(idx) = amount;
+        n++;
+    }
+    fclose(file);
+    return n;
+}
+
+/**
+ * Free every chunk, table and index. No other thread may use the store any more. */
+void acc_free(void) {
+    int i;
+    for (i = 0; i < numchunks; i++) {
+        if (chunks[i] == NULL) break;
+        for (int j = 0; j < CHUNK && i*CHUNK+j < num_accounts; j++) {
+            pthread_rwlock_destroy(&chunks[i]->lock[j].lock);
+        }
+        free(chunks[i]);
+    }
+    for (i = 0; i < numretired; i++) free(retired[i]);
+    free(chunks);
+    free(accindex);
+    chunks = NULL;
+    accindex = NULL;
+    numchunks = numretired = 0;
+    num_accounts = 0;
+}
+
+/**
+ * Read a balance without taking the account lock.
+ * Retries while a writer is in the middle of changing it.
+ * \param idx Account slot.
+ * \return The balance. */
+long long acc_read(int idx) {
+    unsigned *ver = &ACCVERSION(idx);
+    unsigned v;
+    long long b;
+    do {
+        while ((v = __atomic_load_n(ver,__ATOMIC_ACQUIRE)) & 1) ; // writer busy
+        b = __atomic_load_n(&ACCBALANCE(idx),__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(ver,__ATOMIC_ACQUIRE) != v);
+    return b;
+}
+
+/**
+ * Add to a balance with overflow check. The caller holds the write lock.
+ * \param idx Account slot.
+ * \param amount Amount to add, negative to take money out.
+ * \return 0 on success, -1 if the balance would overflow (nothing changes). */
+int acc_add(int idx,long long amount) {
+    long long b,room;
+    if (__builtin_add_overflow(ACCBALANCE(idx),amount,&b)) return -1;
+    if (amount > 0 && __builtin_add_overflow(b,ACCHELD(idx),&room)) return -1; // the room is promised to a prepared transfer
+    unsigned *ver = &ACCVERSION(idx);
+    __atomic_store_n(ver,*ver+1,__ATOMIC_RELEASE); // odd: readers wait
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ACCBALANCE(idx),b,__ATOMIC_RELAXED);
+    __atomic_store_n(ver,*ver+1,__ATOMIC_RELEASE); // even again
+    return 0;
+}
+
+/**
+ * Take money out if there is enough. The caller holds the write lock.
+ * \param idx Account slot.
+ * \param amount Amount to take.
+ * \return 1 on success, 0 if there is not enough money, -1 on overflow. */
+int acc_withdraw(int idx,long long amount) {
+    if (ACCBALANCE(idx) < amount) return 0;
+    long long neg;
+    if (__builtin_sub_overflow(0LL,amount,&neg)) return -1;
+    return acc_add(idx,neg) == 0 ? 1 : -1;
+}
+
+/**
+ * Move money between accounts. The caller holds both write locks.
+ * \param from Account slot to take from.
+ * \param to Account slot to pay to, may be the same as from.
+ * \param amount Amount to move.
+ * \return 1 on success, 0 if there is not enough money, -1 on overflow
+ * (nothing changes unless 1 is returned). */
+int acc_transfer(int from,int to,long long amount) {
+    int ret = acc_withdraw(from,amount);
+    if (ret == 1 && acc_add(to,amount) != 0) { // credit would overflow, give the money back
+        acc_add(from,amount);
+        ret = -1;
+    }
+    return ret;
+}
+
+typedef long long v4ll __attribute__((vector_size(32)));
+typedef unsigned long long v4ull __attribute__((vector_size(32)));
+typedef int v4i __attribute__((vector_size(16)));
+
+/**
+ * Work out the new balances of one chunk, four accounts at a time.
+ * Built for AVX2 as well as plain x86-64, the best one is picked when
+ * the program starts.
+ * \param bal Balances.
+ * \param num Account numbers.
+ * \param len Accounts in use in the chunk.
+ * \param lo Lowest account number to change.
+ * \param hi Highest account number to change.
+ * \param delta Change of every account, NULL if it is amount for all of them.
+ * \param amount Flat change.
+ * \param nb New balances.
+ * \param chg -1 where the account changes, 0 elsewhere.
+ * \param skp -1 where the account is in range but the change does not fit, 0 elsewhere. */
+#if defined(__x86_64__) // other targets take the generic vector code
+__attribute__((target_clones("avx2","default")))
+#endif
+static void bulk_kernel(const long long *bal,const int *num,int len,int lo,int hi,const long long *delta,long long amount,long long *nb,long long *chg,long long *skp) {
+    const v4ll lanes = { 0,1,2,3 };
+    const v4ll flat = { amount,amount,amount,amount };
+    int j;
+    for (j = 0; j < CHUNK; j += 4) {
+        v4ll b,d,c,k;
+        v4i n;
+        memcpy(&b,bal+j,sizeof(b));
+        if (delta != NULL) {
+            memcpy(&d,delta+j,sizeof(d));
+        } else {
+            d = flat;
+        }
+        memcpy(&n,num+j,sizeof(n));
+        v4ll acc = __builtin_convertvector(n,v4ll);
+        v4ll s = (v4ll)((v4ull)b+(v4ull)d); // wraps instead of overflowing, caught below
+        v4ll in = (acc >= lo) & (acc <= hi) & (lanes+j < len);
+        v4ll fits = ~((d >= 0) ^ (s >= b)) & (s >= 0); // no wrap-around and not below zero
+        c = in & fits;
+        k = in & ~fits;
+        memcpy(nb+j,&s,sizeof(s));
+        memcpy(chg+j,&c,sizeof(c));
+        memcpy(skp+j,&k,sizeof(k));
+    }
+}
+
+/**
+ * Change every account in a range of account numbers in one pass, by a
+ * rate or by a flat amount. A change that would overflow or leave the
+ * balance below zero is skipped. The caller holds the write locks of
+ * every account in the range.
+ * \param n Slots to go through, from the first one.
+ * \param lo Lowest account number to change.
+ * \param hi Highest account number to change.
+ * \param rate Nonzero to change by amount basis points of the balance, 0 to add amount.
+ * \param amount Rate (at most BPSCALE either way) or flat change.
+ * \param skipped Set to the number of accounts in range left as they were.
+ * \return Number of accounts changed. */
+int acc_bulk(int n,int lo,int hi,int rate,long long amount,int *skipped) {
+    long long delta[CHUNK],nb[CHUNK],chg[CHUNK],skp[CHUNK];
+    int changed = 0,skip = 0,i,j;
+    for (i = 0; i*CHUNK < n; i++) {
+        struct AccChunk *c = chunks[i];
+        int len = n-i*CHUNK < CHUNK ? n-i*CHUNK : CHUNK;
+        if (rate) {
+            for (j = 0; j < CHUNK; j++) { // split so that nothing overflows while |amount| <= BPSCALE
+                long long b = c->balance[j];
+                delta[j] = b/BPSCALE*amount+b%BPSCALE*amount/BPSCALE;
+            }
+        }
+        bulk_kernel(c->balance,c->accountN,len,lo,hi,rate ? delta : NULL,amount,nb,chg,skp);
+        unsigned long long gone = __atomic_load_n(&c->gone,__ATOMIC_RELAXED);
+        if (gone != 0) { // accounts another node looks after now
+            for (j = 0; j < CHUNK; j++) {
+                if (gone >> j & 1) chg[j] = skp[j] = 0;
+            }
+        }
+        if (__atomic_load_n(&c->holds,__ATOMIC_RELAXED) != 0) { // room kept for prepared transfers is not for bulk changes
+            for (j = 0; j < len; j++) {
+                long long room;
+                if (chg[j] && nb[j] > c->balance[j] && __builtin_add_overflow(nb[j],c->held[j],&room)) {
+                    chg[j] = 0;
+                    skp[j] = -1;
+                }
+            }
+        }
+        int chunkChanged = 0;
+        for (j = 0; j < CHUNK; j++) { // whole chunks, lanes past len are never set, and fixed counts vectorize
+            chunkChanged += chg[j] & 1;
+            skip += skp[j] & 1;
+        }
+        changed += chunkChanged;
+        if (chunkChanged == CHUNK) { // the usual case, the whole chunk changes
+            for (j = 0; j < CHUNK; j++) c->version[j]++; // odd: readers wait
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            memcpy(c->balance,nb,sizeof(nb));
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            for (j = 0; j < CHUNK; j++) c->version[j]++; // even again
+        } else if (chunkChanged > 0) { // accounts out of range may be changing under other locks, leave them be
+            for (j = 0; j < len; j++) c->version[j] += chg[j] & 1;
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            for (j = 0; j < len; j++) {
+                if (chg[j]) c->balance[j] = nb[j];
+            }
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            for (j = 0; j < len; j++) c->version[j] += chg[j] & 1;
+        }
+    }
+    *skipped = skip;
+    return changed;
+}
+
+/**
+ * Mark an account as handed to another cluster node or taken back.
+ * Bulk changes and the details file pass a handed-over account by.
+ * \param idx Account slot, its balance should be zero while it is gone.
+ * \param gone Nonzero when the account leaves, 0 when it comes back. */
+void acc_setgone(int idx,int gone) {
+    unsigned long long bit = 1ULL << idx%CHUNK;
+    if (gone) __atomic_fetch_or(&chunks[idx/CHUNK]->gone,bit,__ATOMIC_RELAXED);
+    else __atomic_fetch_and(&chunks[idx/CHUNK]->gone,~bit,__ATOMIC_RELAXED);
+}
+
+/**
+ * Keep room above a balance for money a prepared transfer may bring in,
+ * so that deposits, transfers and bulk changes cannot take it and the
+ * transfer's second phase cannot fail. The caller holds the write lock.
+ * \param idx Account slot.
+ * \param amount Room to keep, positive.
+ * \return 0 on success, -1 if the balance could not take that much more. */
+int acc_reserve(int idx,long long amount) {
+    long long h,room;
+    if (__builtin_add_overflow(ACCHELD(idx),amount,&h) || __builtin_add_overflow(ACCBALANCE(idx),h,&room)) return -1;
+    if (ACCHELD(idx) == 0) __atomic_fetch_add(&chunks[idx/CHUNK]->holds,1,__ATOMIC_RELAXED);
+    ACCHELD(idx) = h;
+    return 0;
+}
+
+/**
+ * Give back room kept with acc_reserve(). The caller holds the write lock.
+ * \param idx Account slot.
+ * \param amount Room to give back.
+ * \param credit Nonzero to add the amount to the balance, which always fits. */
+void acc_release(int idx,long long amount,int credit) {
+    ACCHELD(idx) -= amount;
+    if (ACCHELD(idx) == 0) __atomic_fetch_sub(&chunks[idx/CHUNK]->holds,1,__ATOMIC_RELAXED);
+    if (credit) acc_add(idx,amount);
+}
+
+/**
+ * Format accounts the way the details file stores them.
+ * \param buf Destination, at least SNAPLINE bytes per account.
+ * \param from First slot.
+ * \param to One past the last slot.
+ * \return Number of bytes written. */
+int acc_format(char *buf,int from,int to) {
+    int len = 0;
+    int i;
+    for (i = from; i < to; i++) {
+        if (__atomic_load_n(&chunks[i/CHUNK]->gone,__ATOMIC_RELAXED) >> i%CHUNK & 1) continue; // left out, so a reload forgets it
+        len += snprintf(buf+len,SNAPLINE,"%d - %lld\n",ACCNUMBER(i),(long long)__atomic_load_n(&ACCBALANCE(i),__ATOMIC_RELAXED));
+    }
+    return len;
+}
@@ -0,0 +1,55 @@
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+#include <pthread.h>
+
+#define CHUNK 64 // accounts per chunk
+#define FIRSTCHUNKS 64 // room in the first chunk table, a new one twice as big replaces it when it fills up
+#define FIRSTINDEX 8192 // hash index slots at first, a power of two; it doubles to stay at least twice the accounts
+#define SNAPLINE 40 // room for one "account - balance" line of the details file
+#define BPSCALE 10000 // basis points in a whole, rates of bulk changes are given in them
+
+struct AccLock { // per-account lock state, alone on its cache line so locking one account leaves its neighbours be
+    pthread_rwlock_t lock;
+    int contended; // how many times a writer has had to wait for the lock
+    int comb; // index of the account's combiner once it has turned hot, -1 before that
+} __attribute__((aligned(64)));
+
+// Balances and versions are packed, so 8 (16) neighbouring accounts share a
+// cache line and writers of neighbours bounce it between cores. Scans and
+// bulk changes are worth more than that; accbench measures both sides.
+struct AccChunk { // CHUNK accounts, hot and cold data in separate arrays
+    long long balance[CHUNK]; // hot, contiguous so scans and bulk operations stream through them
+    unsigned version[CHUNK]; // odd while a writer is changing the balance
+    int accountN[CHUNK]; // cold, only read by lookups and scans
+    long long held[CHUNK]; // room above the balance kept for prepared cross-node transfers, see acc_reserve()
+    int holds; // accounts of the chunk with room held, so bulk changes only look at held when there is some
+    unsigned long long gone; // bit j set while account j has been handed to another cluster node
+    struct AccLock lock[CHUNK];
+};
+
+extern struct AccChunk **chunks;
+extern int num_accounts;
+
+#define ACCCHUNK(i) (__atomic_load_n(&chunks, __ATOMIC_ACQUIRE)[(i) / CHUNK]) // the table may have just been swapped
+#define ACCBALANCE(i) (ACCCHUNK(i)->balance[(i) % CHUNK])
+#define ACCVERSION(i) (ACCCHUNK(i)->version[(i) % CHUNK])
+#define ACCNUMBER(i) (ACCCHUNK(i)->accountN[(i) % CHUNK])
+#define ACCLOCK(i) (ACCCHUNK(i)->lock[(i) % CHUNK])
+#define ACCHELD(i) (ACCCHUNK(i)->held[(i) % CHUNK])
+
+int acc_find(int accN);
+int acc_get(int accN);
+int acc_load(const char *path);
+void acc_free(void);
+long long acc_read(int idx);
+int acc_add(int idx,long long amount);
+int acc_withdraw(int idx,long long amount);
+int acc_transfer(int from,int to,long long amount);
+int acc_bulk(int n,int lo,int hi,int rate,long long amount,int *skipped);
+int acc_format(char *buf,int from,int to);
+void acc_setgone(int idx,int gone);
+int acc_reserve(int idx,long long amount);
+void acc_release(int idx,long long amount,int credit);
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ * Heap allocation counter for make alloctest.
+ * Preloaded into a program (LD_PRELOAD=./allocshim.so), it counts every
+ * malloc(), calloc(), realloc() and aligned allocation, those made inside
+ * the C library included, and writes the total to the file named by
+ * ALLOCS when the program exits. The allocations themselves are left to
+ * the C library through its __libc_ entry points.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n,size_t size);
+extern void *__libc_realloc(void *p,size_t size);
+extern void *__libc_memalign(size_t align,size_t size);
+
+static unsigned long allocs = 0; // every thread adds to it
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&allocs,1,__ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n,size_t size) {
+    __atomic_add_fetch(&allocs,1,__ATOMIC_RELAXED);
+    return __libc_calloc(n,size);
+}
+
+void *realloc(void *p,size_t size) {
+    __atomic_add_fetch(&allocs,1,__ATOMIC_RELAXED);
+    return __libc_realloc(p,size);
+}
+
+void *memalign(size_t align,size_t size) {
+    __atomic_add_fetch(&allocs,1,__ATOMIC_RELAXED);
+    return __libc_memalign(align,size);
+}
+
+void *aligned_alloc(size_t align,size_t size) {
+    return memalign(align,size);
+}
+
+int posix_memalign(void **p,size_t align,size_t size) {
+    void *m = memalign(align,size);
+    if (m == NULL) return ENOMEM;
+    *p = m;
+    return 0;
+}
+
+/**
+ * Write the count out, without allocating on the way. */
+__attribute__((destructor)) static void report(void) {
+    const char *path = getenv("ALLOCS");
+    if (path == NULL) return;
+    char line[64];
+    int len = snprintf(line,sizeof(line),"%lu heap allocations\n",__atomic_load_n(&allocs,__ATOMIC_RELAXED));
+    int fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if (fd == -1) return;
+    if (write(fd,line,len) != len) fprintf(stderr,"Error writing %s.\n",path);
+    close(fd);
+}
@@ -0,0 +1,100 @@
+/**
+ * Per-worker bump allocator and fixed-size object pool.
+ * Memory is only taken from the heap when the arena runs out, so a worker
+ * that has warmed up serves requests without calling malloc().
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ALIGN 16
+
+/**
+ * Add a new block of at least the given size to the arena.
+ * \param a Arena to grow.
+ * \param size Minimum usable size of the block.
+ * \return 0 on success, -1 on failure. */
+static int arena_grow(struct arena *a,size_t size) {
+    if (a->head != NULL && a->head->size > size) size = a->head->size; // don't shrink
+    struct arenablock *b = malloc(sizeof(struct arenablock)+ALIGN+size);
+    if (b == NULL) return -1;
+    b->next = a->head;
+    b->size = size;
+    b->used = 0;
+    a->head = b;
+    a->allocs++;
+    return 0;
+}
+
+/**
+ * Initialize an arena with one block.
+ * \param a Arena to initialize.
+ * \param size Size of the first block.
+ * \return 0 on success, -1 on failure. */
+int arena_init(struct arena *a,size_t size) {
+    a->head = NULL;
+    a->allocs = 0;
+    return arena_grow(a,size);
+}
+
+/**
+ * Free every block of the arena.
+ * \param a Arena to free. */
+void arena_free(struct arena *a) {
+    while (a->head != NULL) {
+        struct arenablock *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+}
+
+/**
+ * Carve memory from the arena. It lives until the arena is freed.
+ * \param a Arena to allocate from.
+ * \param size Number of bytes wanted.
+ * \return Pointer aligned to 16 bytes, NULL on failure. */
+void *arena_alloc(struct arena *a,size_t size) {
+    size = (size+ALIGN-1) & ~(size_t)(ALIGN-1);
+    if (a->head == NULL || a->head->size-a->head->used < size) { // Current block is full
+        if (arena_grow(a,2*size) != 0) return NULL;
+    }
+    char *base = (char *)(a->head+1);
+    base += (ALIGN-((size_t)base % ALIGN)) % ALIGN;
+    void *ret = base+a->head->used;
+    a->head->used += size;
+    return ret;
+}
+
+/**
+ * Initialize a pool of fixed-size objects on top of an arena.
+ * \param p Pool to initialize.
+ * \param a Arena the objects come from.
+ * \param objsize Size of one object. */
+void pool_init(struct pool *p,struct arena *a,size_t objsize) {
+    p->arena = a;
+    p->objsize = objsize < sizeof(void *) ? sizeof(void *) : objsize;
+    p->free = NULL;
+}
+
+/**
+ * Get an object, reusing a returned one when there is any.
+ * \param p Pool to take from.
+ * \return An object (contents undefined), NULL on failure. */
+void *pool_get(struct pool *p) {
+    if (p->free != NULL) {
+        void *obj = p->free;
+        p->free = *(void **)obj;
+        return obj;
+    }
+    return arena_alloc(p->arena,p->objsize);
+}
+
+/**
+ * Return an object to the pool.
+ * \param p Pool the object came from.
+ * \param obj Object to return. */
+void pool_put(struct pool *p,void *obj) {
+    *(void **)obj = p->free;
+    p->free = obj;
+}
@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arenablock {
+    struct arenablock *next; // Older block.
+    size_t size;             // Usable bytes in this block.
+    size_t used;             // Bytes handed out from this block.
+};
+
+struct arena {
+    struct arenablock *head; // Current block, allocations come from here.
+    int allocs;              // Number of blocks added so far.
+};
+
+struct pool {
+    struct arena *arena; // Where new objects are carved from.
+    size_t objsize;      // Size of one object.
+    void *free;          // Returned objects, linked through their first bytes.
+};
+
+int arena_init(struct arena *a,size_t size);
+void arena_free(struct arena *a);
+void *arena_alloc(struct arena *a,size_t size);
+
+void pool_init(struct pool *p,struct arena *a,size_t objsize);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p,void *obj);
+
+#endif
@@ -33,6 +33,7 @@ struct session {
     char response[RESPBUFSIZE];  // buffer for reading responses
 };
 
+char *clientarg = NULL; // extra argument given to every client, if any
 
 /**
  * Initialize a client.
@@ -54,9 +55,12 @@ int client_init(struct session *c,const char *bin) {
         close(STDOUT_FILENO);
         if (dup(pin[1]) == -1) return -1; // dup() failed? abort.
         close(pin[1]); close(pin[0]);
-        execl(bin,bin,NULL);
+        execl(bin,bin,clientarg,NULL);
         return -1; // exec() failed
     } else {
+        close(pin[1]); close(pout[0]); // the client's ends, keeping them would leak two descriptors per client
+        fcntl(pin[0],F_SETFD,FD_CLOEXEC); // and later clients must not hold this one's pipes open
+        fcntl(pout[1],F_SETFD,FD_CLOEXEC);
         c->pid = pid;
         c->fdin = pin[0];
         c->fdout = pout[1];
@@ -98,6 +102,36 @@ int client_reap_pid(struct session *t,int max,int pid) {
     return -1;
 }
 
+#define NUMACCOUNTS 20
+double zipfcdf[NUMACCOUNTS]; // cumulative probabilities for skewed account choice
+int skewed = 0; // pick accounts Zipf-distributed instead of uniformly
+
+/**
+ * Prepare a Zipf (s=1) distribution over the accounts: account k is
+ * picked with probability proportional to 1/(k+1). */
+void zipf_init(void) {
+    double sum = 0;
+    int k;
+    for (k=0; k<NUMACCOUNTS; k++) sum += 1.0/(k+1);
+    double acc = 0;
+    for (k=0; k<NUMACCOUNTS; k++) {
+        acc += 1.0/(k+1)/sum;
+        zipfcdf[k] = acc;
+    }
+    skewed = 1;
+}
+
+/**
+ * Choose an account number for a command.
+ * \return Account number in 0..NUMACCOUNTS-1. */
+int pick_account(void) {
+    if (!skewed) return (int)random() % NUMACCOUNTS;
+    double u = (double)random()/2147483648.0;
+    int k = 0;
+    while (k < NUMACCOUNTS-1 && zipfcdf[k] <= u) k++;
+    return k;
+}
+
 #define CMDBUFSIZ 20
 /**
  * Send a new random command from the client.
@@ -111,21 +145,21 @@ int client_newcmd(struct session *c,int i) {
     switch (r) {
     case 0: // list
     case 1:
-        len = snprintf(cmdbuf,CMDBUFSIZ,"l %d\n",(int)random() % 20);
+        len = snprintf(cmdbuf,CMDBUFSIZ,"l %d\n",pick_account());
         c->state = cmdsent;
         break;
     case 2: // withdraw
     case 3:
-        len = snprintf(cmdbuf,CMDBUFSIZ,"w %d %d\n",(int)random() % 20,(int)random() % 100);
+        len = snprintf(cmdbuf,CMDBUFSIZ,"w %d %d\n",pick_account(),(int)random() % 100);
         c->state = cmdsent;
         break;
     case 4: // deposit
     case 5:
-        len = snprintf(cmdbuf,CMDBUFSIZ,"d %d %d\n",(int)random() % 20,(int)random() % 100);
+        len = snprintf(cmdbuf,CMDBUFSIZ,"d %d %d\n",pick_account(),(int)random() % 100);
         c->state = cmdsent;
         break;
     case 6: // transfer
-        len = snprintf(cmdbuf,CMDBUFSIZ,"t %d %d %d\n",(int)random() % 20,(int)random() % 20,(int)random() % 100);
+        len = snprintf(cmdbuf,CMDBUFSIZ,"t %d %d %d\n",pick_account(),pick_account(),(int)random() % 100);
         c->state = cmdsent;
         break;
     case 7: // quit
@@ -169,12 +203,14 @@ int main(int argc,char **argv) {
     int maxclients = 10;
 
     int opt;
-    while ((opt = getopt(argc,argv,"c:n:s:")) != -1) {
+    while ((opt = getopt(argc,argv,"a:c:n:s:z")) != -1) {
         switch (opt) {
         case 'n': numtests = atoi(optarg); break;
         case 'c': maxclients = atoi(optarg); break;
         case 's': seed = atoi(optarg); break;
-        default: printf("Usage: %s [-c numclients] [-n numtests] [-s seedval] binary\n",argv[0]);
+        case 'z': zipf_init(); break;
+        case 'a': clientarg = optarg; break;
+        default: printf("Usage: %s [-a clientarg] [-c numclients] [-n numtests] [-s seedval] [-z] binary\n",argv[0]);
             return -1;
         }
     }
@@ -190,6 +226,8 @@ int main(int argc,char **argv) {
     char *bin = argv[optind];
 
     signal(SIGPIPE,SIG_IGN); // Let's ignore SIGPIPE
+    struct timespec started,finished;
+    clock_gettime(CLOCK_MONOTONIC,&started);
 
     struct session *clients = calloc(maxclients,sizeof(struct session));
     int numclients = 0;
@@ -249,6 +287,8 @@ int main(int argc,char **argv) {
                         if (c->state == inqueue) {
                             if (strncmp("ready\n",line,6) == 0) {
                                 startnew = 1;
+                            } else if (strncmp("fail:",line,5) == 0) {
+                                c->state = exiting; // turned away as busy, client exits by itself
                             }
                         } if (c->state == cmdsent) {
                             if ((strncmp("ok:",line,3) == 0) ||
@@ -308,7 +348,9 @@ int main(int argc,char **argv) {
         printf(")\n");                    
     }
 
-    printf("Test with %d commands successful\n",numtests);    
+    clock_gettime(CLOCK_MONOTONIC,&finished);
+    double secs = (finished.tv_sec-started.tv_sec)+(finished.tv_nsec-started.tv_nsec)/1e9;
+    printf("Test with %d commands successful (%.2f s, %.0f commands/s)\n",numtests,secs,numtests/secs);    
     free(clients);
     return 0;
 }
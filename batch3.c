@@ -0,0 +1,322 @@
+/*
+ * Offline batch settlement.
+ *
+ * Replays a file of bank commands (the same l/w/t/d lines a client
+ * would send) against a details-file snapshot on all cores. Commands
+ * are split by account: every account sees its commands in file order,
+ * and a transfer waits until both of its accounts have reached it, so
+ * the outcome is the same as running the file line by line. Writes one
+ * result line per command and a single final snapshot.
+ */
+
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "account.h"
+#include "command.h"
+
+#define MAXWORKERS 256
+#define SPINS 100 // dependency checks before yielding the CPU
+
+struct job {
+    struct Command c; // for 'l' the balance read is stored in c.amount
+    int s1,s2;        // account slots, -1 when the command has none
+    int q1,q2;        // position of the command in the sequence of each account, for 'i' and 'f' q1 is the number of accounts open by then
+    int result;       // RES_ value, or 2 for a malformed line
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int *jobs;        // indexes of the jobs this worker owns, in file order
+    int numjobs;
+    int next;         // first of jobs not run yet
+    char *out;        // formatted results of a range of lines
+    int outlen;
+};
+
+struct job *jobs;
+int numjobs;
+char **lines;
+int *done;            // commands completed per account slot
+int segEnd;           // jobs from here on wait for a bulk command to finish
+struct worker workers[MAXWORKERS];
+int numworkers;
+const char errMsg[] = "fail: Error in command\n";
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/**
+ * Parse a share of the lines.
+ * \param arg Worker.
+ * \return NULL. */
+void *parse_routine(void *arg) {
+    struct worker *w = arg;
+    int from = (long long)numjobs*w->id/numworkers,to = (long long)numjobs*(w->id+1)/numworkers;
+    int i;
+    for (i = from; i < to; i++) {
+        jobs[i].result = cmd_parse(lines[i],&jobs[i].c) == 0 ? RES_OK : 2;
+        if (cmd_isnode(jobs[i].c.cmd)) jobs[i].c.cmd = '?'; // cluster node commands mean nothing offline
+    }
+    return NULL;
+}
+
+/**
+ * Wait until the job is next in line on an account.
+ * \param slot Account slot.
+ * \param seq Position of the job on that account. */
+void wait_turn(int slot,int seq) {
+    int spins = 0;
+    while (__atomic_load_n(&done[slot],__ATOMIC_ACQUIRE) != seq) {
+        if (++spins == SPINS) {
+            sched_yield(); // the account is with another worker, let it run
+            spins = 0;
+        }
+    }
+}
+
+/**
+ * Run the jobs of a worker up to the next bulk command. Only the job
+ * whose turn it is touches an account, so no locks are needed.
+ * \param arg Worker.
+ * \return NULL. */
+void *settle_routine(void *arg) {
+    struct worker *w = arg;
+    for (; w->next < w->numjobs && w->jobs[w->next] < segEnd; w->next++) {
+        struct job *j = &jobs[w->jobs[w->next]];
+        wait_turn(j->s1,j->q1);
+        if (j->s2 != j->s1) wait_turn(j->s2,j->q2);
+        switch (j->c.cmd) {
+        case 'l': j->c.amount = ACCBALANCE(j->s1); break;
+        case 'w': j->result = acc_withdraw(j->s1,j->c.amount); break;
+        case 'd': j->result = acc_add(j->s1,j->c.amount) == 0 ? RES_OK : RES_OVERFLOW; break;
+        case 't': j->result = acc_transfer(j->s1,j->s2,j->c.amount); break;
+        }
+        __atomic_store_n(&done[j->s1],j->q1+1,__ATOMIC_RELEASE);
+        if (j->s2 != j->s1) __atomic_store_n(&done[j->s2],j->q2+1,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * Format the results of a share of the lines.
+ * \param arg Worker.
+ * \return NULL, w->out is NULL if memory ran out. */
+void *reply_routine(void *arg) {
+    struct worker *w = arg;
+    int from = (long long)numjobs*w->id/numworkers,to = (long long)numjobs*(w->id+1)/numworkers;
+    w->out = malloc((size_t)(to-from)*REPLYSIZE+1);
+    w->outlen = 0;
+    if (w->out == NULL) return NULL;
+    int i;
+    for (i = from; i < to; i++) {
+        struct job *j = &jobs[i];
+        if (j->result == 2) {
+            memcpy(w->out+w->outlen,errMsg,sizeof(errMsg)-1);
+            w->outlen += sizeof(errMsg)-1;
+        } else {
+            w->outlen += cmd_reply(&j->c,j->result,j->c.amount,w->out+w->outlen);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run a routine on every worker and wait for all of them.
+ * \param fn Routine. */
+void run_all(void *(*fn)(void *)) {
+    int i;
+    for (i = 0; i < numworkers; i++) {
+        if (pthread_create(&workers[i].thread,NULL,fn,&workers[i]) != 0) {
+            fn(&workers[i]); // no thread, do its share here
+            workers[i].thread = pthread_self();
+        }
+    }
+    for (i = 0; i < numworkers; i++) {
+        if (!pthread_equal(workers[i].thread,pthread_self())) pthread_join(workers[i].thread,NULL);
+    }
+}
+
+/**
+ * Write a whole buffer to a new file, replacing the old one only when done.
+ * \param path File to write.
+ * \param data Contents.
+ * \param len Length of data.
+ * \return 0 on success, -1 on failure. */
+int write_file(const char *path,const char *data,size_t len) {
+    char tmp[4096];
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    int fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) return -1;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t r = write(fd,data+off,len-off);
+        if (r <= 0) { close(fd); return -1; }
+        off += r;
+    }
+    close(fd);
+    return rename(tmp,path);
+}
+
+/**
+ * Main function.
+ * \param argc Argument count.
+ * \param argv Argument table.
+ * \return 0 on success. */
+int main(int argc,char **argv) {
+    char *snapin = "account_details.txt",*snapout = NULL,*results = "batch_results.txt";
+    numworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc,argv,"j:s:o:r:")) != -1) {
+        switch (opt) {
+        case 'j': numworkers = atoi(optarg); break;
+        case 's': snapin = optarg; break;
+        case 'o': snapout = optarg; break;
+        case 'r': results = optarg; break;
+        default: printf("Usage: %s [-j threads] [-s snapshot] [-o newsnapshot] [-r results] commandfile\n",argv[0]);
+            return -1;
+        }
+    }
+    if (optind >= argc) {
+        printf("Missing command file\n");
+        return -1;
+    }
+    if (numworkers < 1) numworkers = 1;
+    if (numworkers > MAXWORKERS) numworkers = MAXWORKERS;
+    if (snapout == NULL) snapout = snapin;
+    int i;
+    for (i = 0; i < numworkers; i++) workers[i].id = i;
+
+    // Read the whole command file, making sure the last line ends too
+    int fd = open(argv[optind],O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd,&st) == -1) {
+        printf("Cannot open %s\n",argv[optind]);
+        return -1;
+    }
+    char *data = malloc(st.st_size+1);
+    if (data == NULL) return -1;
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t r = read(fd,data+got,st.st_size-got);
+        if (r <= 0) break;
+        got += r;
+    }
+    close(fd);
+    if (got > 0 && data[got-1] != '\n') data[got++] = '\n';
+
+    if (acc_load(snapin) < 0) printf("No snapshot %s, starting without accounts\n",snapin);
+    double start = now();
+
+    numjobs = 0;
+    char *p;
+    for (p = data; (p = memchr(p,'\n',data+got-p)) != NULL; p++) numjobs++;
+    lines = malloc(numjobs*sizeof(char *));
+    jobs = malloc(numjobs*sizeof(struct job));
+    int maxslots = num_accounts+2*numjobs+1; // each command adds two accounts at most
+    done = calloc(maxslots,sizeof(int));
+    int *seqs = calloc(maxslots,sizeof(int));
+    if (lines == NULL || jobs == NULL || done == NULL || seqs == NULL) {
+        printf("Out of memory\n");
+        return -1;
+    }
+    char *line = data;
+    for (i = 0; i < numjobs; i++) {
+        lines[i] = line;
+        line = (char *)memchr(line,'\n',data+got-line)+1;
+    }
+    run_all(parse_routine);
+
+    // Give every command its place in the sequence of each account it touches
+    int *owned = calloc(numworkers,sizeof(int));
+    if (owned == NULL) return -1;
+    for (i = 0; i < numjobs; i++) {
+        struct job *j = &jobs[i];
+        j->s1 = j->s2 = -1;
+        char c = j->c.cmd;
+        if (j->result == RES_OK && (c == 'i' || c == 'f')) { // a barrier, applied once everything before it is done
+            j->q1 = num_accounts;
+            continue;
+        }
+        if (j->result != RES_OK || (c != 'l' && c != 'w' && c != 't' && c != 'd')) continue;
+        j->s1 = acc_get(j->c.acc1);
+        j->s2 = c == 't' ? acc_get(j->c.acc2) : j->s1;
+        if (j->s1 < 0 || j->s2 < 0) {
+            j->s1 = j->s2 = -1;
+            j->result = RES_FULL;
+            continue;
+        }
+        j->q1 = seqs[j->s1]++;
+        j->q2 = j->s2 != j->s1 ? seqs[j->s2]++ : j->q1;
+        owned[j->s1 % numworkers]++;
+    }
+    for (i = 0; i < numworkers; i++) {
+        workers[i].jobs = malloc((owned[i]+1)*sizeof(int));
+        if (workers[i].jobs == NULL) return -1;
+        workers[i].numjobs = 0;
+        workers[i].next = 0;
+    }
+    for (i = 0; i < numjobs; i++) {
+        if (jobs[i].s1 < 0) continue;
+        struct worker *w = &workers[jobs[i].s1 % numworkers];
+        w->jobs[w->numjobs++] = i;
+    }
+    double prepared = now();
+    for (i = 0; i <= numjobs; i++) { // run in segments, split by the bulk commands
+        int last = i == numjobs;
+        if (!last && (jobs[i].result != RES_OK || (jobs[i].c.cmd != 'i' && jobs[i].c.cmd != 'f'))) continue;
+        segEnd = i;
+        run_all(settle_routine);
+        if (!last) { // every account is at rest now
+            struct job *j = &jobs[i];
+            double t = now();
+            j->c.changed = acc_bulk(j->q1,j->c.acc1,j->c.acc2,j->c.cmd == 'i',j->c.amount,&j->c.skipped);
+            j->c.seconds = now()-t;
+        }
+    }
+    double settled = now();
+    run_all(reply_routine);
+
+    // Results in file order, then the final snapshot
+    FILE *rf = fopen(results,"w");
+    if (rf == NULL) {
+        printf("Cannot write %s\n",results);
+        return -1;
+    }
+    for (i = 0; i < numworkers; i++) {
+        if (workers[i].out == NULL) {
+            printf("Out of memory\n");
+            return -1;
+        }
+        fwrite(workers[i].out,1,workers[i].outlen,rf);
+        free(workers[i].out);
+    }
+    fclose(rf);
+    char *snap = malloc((size_t)num_accounts*SNAPLINE+1);
+    if (snap == NULL || write_file(snapout,snap,acc_format(snap,0,num_accounts)) != 0) {
+        printf("Cannot write %s\n",snapout);
+        return -1;
+    }
+    double finished = now();
+
+    printf("%d commands, %d accounts, %d threads\n",numjobs,num_accounts,numworkers);
+    printf("prepare %.3f s, settle %.3f s, total %.3f s (%.0f commands/s)\n",
+        prepared-start,settled-prepared,finished-start,numjobs/(finished-start));
+
+    for (i = 0; i < numworkers; i++) free(workers[i].jobs);
+    free(snap); free(owned); free(seqs); free(done); free(jobs); free(lines); free(data);
+    acc_free();
+    return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * Traffic capture.
+ * Every command line a desk receives is recorded with its arrival time,
+ * session and reply, for replay3 to play back later. Ticks of a shared
+ * counter taken as the command arrives and as its reply is ready tell
+ * which commands followed each other and which ran at the same time.
+ * Each thread fills a
+ * buffer of its own and appends it to the file in one write when it is
+ * full, so records of different threads come in blocks; within a
+ * session they are always in order, since one desk serves a session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "capture.h"
+
+struct capbuf {
+    int len;
+    char data[CAPBUF];
+};
+
+int captureOn = 0;                   // command lines are being recorded
+static int fd = -1;
+static long long origin;             // start of the capture on the monotonic clock
+static unsigned sessions = 0;        // session numbers handed out
+static unsigned ticks = 0;           // orders the commands of all threads
+static pthread_mutex_t fileM = PTHREAD_MUTEX_INITIALIZER;
+static struct capbuf **bufs = NULL;
+static int numbufs = 0;
+static _Thread_local struct capbuf *buf = NULL;
+static _Thread_local int waiting = -1; // offset in buf of the record still without its reply
+
+static long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec-origin;
+}
+
+static void append(const void *data,int len) { // with fileM held
+    if (write(fd,data,len) != len) fprintf(stderr,"Error writing the capture file.\n");
+}
+
+/**
+ * Start a capture.
+ * \param path Capture file, truncated.
+ * \param threads Number of threads that will call capture_thread().
+ * \return 0 on success, -1 on failure. */
+int capture_open(const char *path,int threads) {
+    bufs = calloc(threads,sizeof(struct capbuf *));
+    if (bufs == NULL) return -1;
+    numbufs = threads;
+    int i;
+    for (i = 0; i < threads; i++) {
+        if ((bufs[i] = malloc(sizeof(struct capbuf))) == NULL) {
+            capture_close();
+            return -1;
+        }
+        bufs[i]->len = 0;
+    }
+    fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if (fd == -1) {
+        capture_close();
+        return -1;
+    }
+    int magic = CAPMAGIC;
+    origin = 0;
+    origin = now();
+    append(&magic,sizeof(magic));
+    captureOn = 1;
+    return 0;
+}
+
+/**
+ * Attach the calling thread to its buffer.
+ * \param t Thread number, less than the count given to capture_open(). */
+void capture_thread(int t) {
+    buf = t < numbufs ? bufs[t] : NULL;
+}
+
+/**
+ * \return Number for a new session, never CAPSNAPSHOT. */
+unsigned capture_session(void) {
+    return __atomic_add_fetch(&sessions,1,__ATOMIC_RELAXED);
+}
+
+/**
+ * Record a command line arriving now, capture_reply() completes it.
+ * \param session Its session.
+ * \param line The line, up to its newline or end. */
+void capture_add(unsigned session,const char *line) {
+    if (buf == NULL) return;
+    struct caprec r = { now(),session,strcspn(line,"\n"),0,0,0 };
+    if (buf->len+sizeof(r)+r.len+CAPREPLY > CAPBUF) capture_flush(); // the reply has to fit as well
+    r.start = __atomic_add_fetch(&ticks,1,__ATOMIC_ACQ_REL);
+    waiting = buf->len;
+    memcpy(buf->data+buf->len,&r,sizeof(r));
+    memcpy(buf->data+buf->len+sizeof(r),line,r.len);
+    buf->len += sizeof(r)+r.len;
+}
+
+/**
+ * Record the reply to the thread's last command, as soon as its effect
+ * is in the accounts.
+ * \param reply The reply, up to its newline or end. */
+void capture_reply(const char *reply) {
+    if (buf == NULL || waiting < 0) return;
+    struct caprec *r = (struct caprec *)(buf->data+waiting);
+    r->end = __atomic_add_fetch(&ticks,1,__ATOMIC_ACQ_REL); // after the command's changes, before the next command's start
+    r->rlen = strcspn(reply,"\n");
+    if (r->rlen > CAPREPLY) r->rlen = CAPREPLY;
+    memcpy(buf->data+buf->len,reply,r->rlen);
+    buf->len += r->rlen;
+    waiting = -1;
+}
+
+/**
+ * Record the accounts as they are now, straight to the file.
+ * \param snap Account details in the usual "account - balance" lines.
+ * \param len Its length. */
+void capture_snapshot(const char *snap,int len) {
+    if (fd == -1) return;
+    struct caprec r = { now(),CAPSNAPSHOT,len,0,0,0 };
+    pthread_mutex_lock(&fileM);
+    append(&r,sizeof(r));
+    append(snap,len);
+    pthread_mutex_unlock(&fileM);
+}
+
+/**
+ * Write out what the calling thread has buffered. */
+void capture_flush(void) {
+    if (buf == NULL || buf->len == 0) return;
+    pthread_mutex_lock(&fileM);
+    append(buf->data,buf->len);
+    pthread_mutex_unlock(&fileM);
+    buf->len = 0;
+    waiting = -1; // only between commands, a record still waiting would be gone already
+}
+
+/**
+ * End the capture. Every thread must have flushed its buffer.
+ * \return 0 on success, -1 if the file could not be finished. */
+int capture_close(void) {
+    int i,ret = 0;
+    if (fd != -1 && close(fd) != 0) ret = -1;
+    fd = -1;
+    for (i = 0; i < numbufs; i++) free(bufs[i]);
+    free(bufs);
+    bufs = NULL;
+    numbufs = 0;
+    captureOn = 0;
+    return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#define CAPMAGIC 0x32414342 // "BCA2" at the start of a capture, the records have carried replies since version 2
+#define CAPBUF 65536 // bytes buffered per thread before they go to the file
+#define CAPSNAPSHOT 0 // session number of the account snapshots at the start and end of a capture
+#define CAPREPLY 100 // longest reply recorded, the server's REPLYSIZE
+
+struct caprec { // capture file: the magic, then these, each followed by len and then rlen bytes
+    long long ns;     // Arrival time, nanoseconds since the capture started.
+    unsigned session; // Session number, CAPSNAPSHOT for a snapshot.
+    unsigned len;     // A command line without its newline, or a whole account details file.
+    unsigned start;   // Tick of a counter shared by all desks when the command arrived,
+    unsigned end;     // and when its reply was ready: a command ended before another started if its end is lower.
+    unsigned rlen;    // The reply without its newline, 0 for a snapshot.
+} __attribute__((packed)); // records follow each other without padding
+
+extern int captureOn;
+
+int capture_open(const char *path,int threads);
+void capture_thread(int thread);
+unsigned capture_session(void);
+void capture_add(unsigned session,const char *line);
+void capture_reply(const char *reply);
+void capture_snapshot(const char *snap,int len);
+void capture_flush(void);
+int capture_close(void);
+
+#endif
@@ -6,30 +6,98 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <assert.h>
+#include <poll.h>
+
+#include "fdpass.h"
+#include "shmring.h"
 
 #define MAX_LENGTH 100 // max length for input and output
+#define SHMCLIENT 2 // connection flag asking the desk for a shared-memory channel
+#define ADMINCLIENT 4 // connection flag of an operator, who may send the bulk commands
 
 void copydata(int from, int to) {
   int amount;
-  char buf[1024], resp[100];
+  char buf[1024], resp[1024];
   ssize_t r; // returned bytes
+  int have = 0; // response bytes not printed yet
 
   while ((amount = read(from, buf, sizeof(buf))) > 0) { // infinite loop
     assert((write(to, buf, amount) == amount)); // write to socket
-    assert((r = read(to, &resp, sizeof(resp))) != -1); // receive from socket (stops the execution)
-    resp[r] = '\0'; // null terminate to indicate a string
-    printf("%s", resp); // display the info
+    int expect = 0; // the desk answers every complete line separately
+    int i;
+    for (i = 0; i < amount; i++) {
+      if (buf[i] == '\n') {
+        expect++;
+      }
+    }
+    while (expect > 0) {
+      assert((r = read(to, resp + have, sizeof(resp) - have - 1)) > 0); // receive from socket (stops the execution)
+      have += r;
+      resp[have] = '\0';
+      char *p = resp;
+      while (expect > 0 && memchr(p, '\0', resp + have - p) != NULL) { // every response ends with a null
+        printf("%s", p); // display the info
+        expect--;
+        if (strcmp(p, "ok: Quit the desk\n") == 0) { // if received the quit command, quit reading
+          fflush(stdout);
+          return;
+        }
+        p += strlen(p) + 1;
+      }
+      have = resp + have - p; // keep a response cut in half for the next read
+      memmove(resp, p, have);
+    }
     fflush(stdout);
+  }
+  assert(amount >= 0);
+}
+
+void shmcopy(int from, struct shmchan *c, int sock) { // same as copydata, but commands go through shared memory
+  char buf[1024], resp[MAX_LENGTH + 1];
+  int have = 0, amount, r;
+
+  while ((amount = read(from, buf + have, sizeof(buf) - have)) > 0) {
+    have += amount;
+    char *start = buf, *nl;
+    while ((nl = memchr(start, '\n', buf + have - start)) != NULL) { // one record per command line
+      int len = nl - start + 1;
+      assert((shmring_push(&c->req, start, len > RECSIZE ? RECSIZE : len)) == 0); // we wait for every response, the ring can't fill up
+      while ((r = shmring_pop(&c->resp, resp, MAX_LENGTH, NULL, 1000)) == -1) { // no response yet, is the desk still there
+        struct pollfd p = { sock, POLLIN, 0 };
+        assert((poll(&p, 1, 0)) == 0);
+      }
+      resp[r] = '\0'; // null terminate to indicate a string
+      printf("%s", resp); // display the info
+      fflush(stdout);
 
-    if (strcmp(resp, "ok: Quit the desk\n") == 0) { // if received the quit command, quit reading
-        break;
+      if (strcmp(resp, "ok: Quit the desk\n") == 0) { // if received the quit command, quit reading
+        return;
+      }
+      start = nl + 1;
+    }
+    have = buf + have - start; // keep the unfinished line for the next read
+    memmove(buf, start, have);
+    if (have == sizeof(buf)) { // no newline in a whole buffer, drop it
+      have = 0;
     }
   }
   assert(amount >= 0);
 }
 
 
-int main(void) {
+int main(int argc, char **argv) {
+  int useShm = 0, admin = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "ma")) != -1) {
+    switch (opt) {
+      case 'm': useShm = 1; break; // send commands through shared memory instead of the socket
+      case 'a': admin = ADMINCLIENT; break; // an operator's session, the bank checks that we run as its user
+      default:
+        fprintf(stderr, "Usage: %s [-m] [-a]\n", argv[0]);
+        return -1;
+    }
+  }
+
   struct sockaddr_un address;
   int sock, newsock; // sock = main socket, newsock = desk socket
   size_t addrLength;
@@ -44,6 +112,11 @@ int main(void) {
   assert((read(sock, &res, sizeof(res))) != -1); // read the forwarded socket
 
   close(sock); // close the prev connection
+  if (strncmp(res, "fail:", 5) == 0) { // the bank is too busy to take us in, no desk path to follow
+    printf("%s", res);
+    fflush(stdout);
+    return 0;
+  }
 
   assert((newsock = socket(AF_UNIX, SOCK_STREAM, 0)) != -1); // new socket time
   address.sun_family = AF_UNIX;
@@ -51,15 +124,29 @@ int main(void) {
   addrLength = sizeof(address.sun_family) + strlen(address.sun_path);
   assert((connect(newsock, (struct sockaddr*) &address, addrLength)) != -1); // connect to the desk socket
 
-  int isBank = 0; // send flag
+  int isBank = (useShm ? SHMCLIENT : 0) | admin; // send flag
   assert((write(newsock, &isBank, sizeof(int))) != -1);
 
   char ress[MAX_LENGTH];
-  assert((read(newsock, &ress, sizeof(ress))) != -1);
+  int chanfd = -1; // shared-memory channel, if the desk gave us one
+  assert((fd_recv(newsock, &ress, sizeof(ress), &chanfd)) != -1);
   printf("%s", ress); // our read response includes a newline already
   fflush(stdout);
+  if (strncmp(ress, "fail:", 5) == 0) { // waited in the desk queue past the deadline
+    close(newsock);
+    return 0;
+  }
 
-  copydata(STDIN_FILENO, newsock); // keep sending data until we have received an ack from our quit command
+  if (chanfd != -1) {
+    struct shmchan *c = shmchan_map(chanfd);
+    assert(c != NULL);
+    close(chanfd);
+    shmcopy(STDIN_FILENO, c, newsock);
+    shmchan_close(c);
+    shmchan_unmap(c);
+  } else {
+    copydata(STDIN_FILENO, newsock); // keep sending data until we have received an ack from our quit command
+  }
 
   close(newsock);
   return 0;
@@ -0,0 +1,142 @@
+/**
+ * Bank command grammar and reply texts, shared by the server and the
+ * batch tool so both speak exactly the same language.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "account.h"
+#include "command.h"
+
+/**
+ * Parse one command line.
+ * \param line The line, a trailing newline is cut off in place.
+ * \param c Parsed command.
+ * \return 0 if the line is a command (possibly an unknown one), -1 if
+ * it is malformed. */
+int cmd_parse(char *line,struct Command *c) {
+    c->cmd = line[0];
+    c->acc1 = 0;
+    c->acc2 = 0;
+    c->amount = 0;
+    c->changed = c->skipped = 0;
+    c->seconds = 0;
+    line[strcspn(line,"\n")] = '\0'; // remove trailing newline
+
+    switch (c->cmd) { // scan the others, the next char must always be a space
+    case 'l': // of form l acc1
+        return (sscanf(line,"l %d",&c->acc1) == 1 && line[1] == ' ') ? 0 : -1;
+    case 'w': // of form w acc1 amount
+        return (sscanf(line,"w %d %lld",&c->acc1,&c->amount) == 2 && line[1] == ' ') ? 0 : -1;
+    case 't': // of form t acc1 acc2 amount
+        return (sscanf(line,"t %d %d %lld",&c->acc1,&c->acc2,&c->amount) == 3 && line[1] == ' ') ? 0 : -1;
+    case 'd': // of form d acc1 amount
+        return (sscanf(line,"d %d %lld",&c->acc1,&c->amount) == 2 && line[1] == ' ') ? 0 : -1;
+    case 'i': // of form i rate [first last], rate in basis points, a negative one is a fee
+    case 'f': { // of form f amount [first last], a negative amount is a fee
+        int n = sscanf(line+1,"%lld %d %d",&c->amount,&c->acc1,&c->acc2);
+        if (n == 1) { // no range, every account
+            c->acc1 = INT_MIN;
+            c->acc2 = INT_MAX;
+        }
+        if (c->cmd == 'i' && (c->amount > BPSCALE || c->amount < -BPSCALE)) return -1;
+        return ((n == 1 || n == 3) && line[1] == ' ') ? 0 : -1;
+    }
+    case 'q': // q must be the only letter
+        return strlen(line) == 1 ? 0 : -1;
+    case 'p': // of form p transaction acc1 amount, sent by a cluster router to prepare one side of a transfer
+        return (sscanf(line,"p %d %d %lld",&c->acc2,&c->acc1,&c->amount) == 3 && line[1] == ' '
+            && c->amount != LLONG_MIN) ? 0 : -1;
+    case 'c': // of form c transaction, commit a prepared side
+    case 'a': // of form a transaction, abort a prepared side
+        return (sscanf(line+1," %d",&c->acc2) == 1 && line[1] == ' ') ? 0 : -1;
+    case 'e': // of form e bucket, hand a bucket's accounts over to another node
+    case 'g': // of form g bucket, take them over
+        return (sscanf(line+1," %d",&c->acc1) == 1 && line[1] == ' '
+            && c->acc1 >= 0 && c->acc1 < NUMBUCKETS) ? 0 : -1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Tell the cluster node commands apart, only a router may send them.
+ * \param cmd Command letter.
+ * \return Nonzero for 'p', 'c', 'a', 'e' and 'g'. */
+int cmd_isnode(char cmd) {
+    return cmd != '\0' && strchr("pcaeg",cmd) != NULL;
+}
+
+/**
+ * Tell the bulk commands apart, only an operator's session may send them.
+ * \param cmd Command letter.
+ * \return Nonzero for 'i' and 'f'. */
+int cmd_isadmin(char cmd) {
+    return cmd != '\0' && strchr("if",cmd) != NULL;
+}
+
+/**
+ * Hash bucket of an account number.
+ * \param acc Account number.
+ * \return Bucket, 0 to NUMBUCKETS-1, neighbouring accounts land in
+ * different buckets. */
+int cmd_bucket(int acc) {
+    return ((unsigned)acc*2654435761u) >> 26; // Fibonacci hashing, the top 6 bits
+}
+
+/**
+ * Format the reply to a command.
+ * \param c The command.
+ * \param result Outcome, one of the RES_ values.
+ * \param balance Balance for 'l'.
+ * \param reply Destination, REPLYSIZE bytes.
+ * \return Length of the reply. */
+int cmd_reply(const struct Command *c,int result,long long balance,char *reply) {
+    if (result == RES_FULL) return snprintf(reply,REPLYSIZE,"fail: Too many accounts\n");
+    switch (c->cmd) {
+    case 'l':
+        return snprintf(reply,REPLYSIZE,"ok: Balance of account %d: %lld\n",c->acc1,balance);
+    case 'w':
+        if (result == RES_OK) return snprintf(reply,REPLYSIZE,"ok: Withdrew %lld from account %d\n",c->amount,c->acc1);
+        if (result == RES_NOMONEY) return snprintf(reply,REPLYSIZE,"fail: Not enough money on account %d\n",c->acc1);
+        return snprintf(reply,REPLYSIZE,"fail: Balance overflow on account %d\n",c->acc1);
+    case 't':
+        if (result == RES_OK) return snprintf(reply,REPLYSIZE,"ok: Transferred %lld from account %d to account %d\n",c->amount,c->acc1,c->acc2);
+        if (result == RES_NOMONEY) return snprintf(reply,REPLYSIZE,"fail: Not enough money on account %d\n",c->acc1);
+        return snprintf(reply,REPLYSIZE,"fail: Balance overflow on account %d\n",c->acc2);
+    case 'd':
+        if (result == RES_OK) return snprintf(reply,REPLYSIZE,"ok: Deposited %lld to account %d\n",c->amount,c->acc1);
+        return snprintf(reply,REPLYSIZE,"fail: Balance overflow on account %d\n",c->acc1);
+    case 'i':
+    case 'f': {
+        double rate = c->seconds > 0 ? (c->changed+c->skipped)/c->seconds : 0;
+        return snprintf(reply,REPLYSIZE,"ok: Applied %lld%s to %d accounts, %d skipped, %.0f accounts/s\n",
+            c->amount,c->cmd == 'i' ? " bp" : "",c->changed,c->skipped,rate);
+    }
+    case 'q':
+        return snprintf(reply,REPLYSIZE,"ok: Quit the desk\n");
+    case 'p':
+        if (result == RES_OK && c->amount < 0) return snprintf(reply,REPLYSIZE,"ok: Reserved %lld from account %d for transaction %d\n",-c->amount,c->acc1,c->acc2);
+        if (result == RES_OK) return snprintf(reply,REPLYSIZE,"ok: Ready to credit %lld to account %d for transaction %d\n",c->amount,c->acc1,c->acc2);
+        if (result == RES_NOMONEY) return snprintf(reply,REPLYSIZE,"fail: Not enough money on account %d\n",c->acc1);
+        if (result == RES_PENDING) return snprintf(reply,REPLYSIZE,"fail: Too many transactions in flight\n");
+        if (result == RES_NOTX) return snprintf(reply,REPLYSIZE,"fail: Transaction %d was aborted\n",c->acc2);
+        return snprintf(reply,REPLYSIZE,"fail: Balance overflow on account %d\n",c->acc1);
+    case 'c':
+    case 'a':
+        if (result == RES_NOTX) return snprintf(reply,REPLYSIZE,"fail: Unknown transaction %d\n",c->acc2);
+        if (result == RES_OVERFLOW) return snprintf(reply,REPLYSIZE,"fail: Balance overflow on account %d\n",c->acc1);
+        if (c->cmd == 'c' && c->amount > 0) return snprintf(reply,REPLYSIZE,"ok: Credited %lld to account %d for transaction %d\n",c->amount,c->acc1,c->acc2);
+        if (c->cmd == 'a' && c->amount < 0) return snprintf(reply,REPLYSIZE,"ok: Released %lld to account %d for transaction %d\n",-c->amount,c->acc1,c->acc2);
+        return snprintf(reply,REPLYSIZE,"ok: %s transaction %d\n",c->cmd == 'c' ? "Committed" : "Aborted",c->acc2);
+    case 'e':
+    case 'g':
+        if (result == RES_IO) return snprintf(reply,REPLYSIZE,"fail: Cannot %s bucket %d\n",c->cmd == 'e' ? "write" : "read",c->acc1);
+        if (result == RES_OVERFLOW) return snprintf(reply,REPLYSIZE,"fail: Balance overflow in bucket %d\n",c->acc1);
+        return snprintf(reply,REPLYSIZE,"ok: %s %d accounts of bucket %d\n",c->cmd == 'e' ? "Exported" : "Imported",c->changed,c->acc1);
+    default:
+        return snprintf(reply,REPLYSIZE,"fail: Invalid command\n");
+    }
+}
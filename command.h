@@ -0,0 +1,29 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#define REPLYSIZE 100 // longest reply, same as MAX_LENGTH of the server
+#define NUMBUCKETS 64 // hash buckets of account numbers, what a cluster hands out to its nodes and moves between them
+#define BUCKETFILE "bucket_%d.txt" // a bucket on its way between nodes, in the cluster directory above the node directories
+
+enum { RES_OK = 1, RES_NOMONEY = 0, RES_OVERFLOW = -1, RES_FULL = -2, // outcomes of a command
+       RES_PENDING = -3, RES_NOTX = -4, RES_IO = -5 }; // too many prepared transfers, unknown transaction, bucket file trouble
+
+struct Command {
+    char cmd;         // 'l', 'w', 't', 'd', 'i', 'f', 'q', the cluster node commands 'p', 'c', 'a', 'e', 'g',
+                      // or anything else for an invalid command
+    int acc1,acc2;    // accounts, acc2 only for transfers, the range of account numbers for 'i' and 'f',
+                      // the transaction for 'p', 'c' and 'a', acc1 is the bucket for 'e' and 'g'
+    long long amount; // rate in basis points for 'i', negative for the paying side of 'p'
+    // outcome of 'i' and 'f', filled in by whoever carries them out
+    int changed;      // accounts changed
+    int skipped;      // accounts in range where the change did not fit
+    double seconds;   // time the pass took
+};
+
+int cmd_parse(char *line,struct Command *c);
+int cmd_bucket(int acc);
+int cmd_isnode(char cmd);
+int cmd_isadmin(char cmd);
+int cmd_reply(const struct Command *c,int result,long long balance,char *reply);
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * Passing file descriptors over UNIX sockets (SCM_RIGHTS).
+ * Every message carries some ordinary data too, so the receiver can
+ * read it like any other reply. The credentials of the process at the
+ * other end are checked here as well.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "fdpass.h"
+
+/**
+ * Send data together with a file descriptor.
+ * \param sock Connected UNIX socket.
+ * \param data Data to send along.
+ * \param len Length of data, at least 1.
+ * \param fd Descriptor to pass.
+ * \return Number of bytes sent, or -1 on error. */
+int fd_send(int sock,const void *data,int len,int fd) {
+    struct iovec iov = { (void *)data,len };
+    char ctl[CMSG_SPACE(sizeof(int))];
+    memset(ctl,0,sizeof(ctl));
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm),&fd,sizeof(int));
+    return sendmsg(sock,&msg,0);
+}
+
+/**
+ * Receive data and possibly a file descriptor.
+ * \param sock Connected UNIX socket.
+ * \param data Buffer for the data.
+ * \param len Size of data.
+ * \param fd Set to the received descriptor, or -1 if none came along.
+ * \return Number of bytes received, 0 on EOF, -1 on error. */
+int fd_recv(int sock,void *data,int len,int *fd) {
+    struct iovec iov = { data,len };
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    *fd = -1;
+    int ret = recvmsg(sock,&msg,MSG_CMSG_CLOEXEC);
+    if (ret <= 0) return ret;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd,CMSG_DATA(cm),sizeof(int));
+    }
+    return ret;
+}
+
+/**
+ * Check who is at the other end of a socket (SO_PEERCRED).
+ * \param sock Connected UNIX socket.
+ * \return 1 if the process runs as our user or as root, 0 if not or unknown. */
+int fd_trusted(int sock) {
+    struct ucred cr;
+    socklen_t len = sizeof(cr);
+    if (getsockopt(sock,SOL_SOCKET,SO_PEERCRED,&cr,&len) != 0) return 0;
+    return cr.uid == 0 || cr.uid == geteuid();
+}
@@ -0,0 +1,8 @@
+#ifndef FDPASS_H
+#define FDPASS_H
+
+int fd_send(int sock,const void *data,int len,int fd);
+int fd_recv(int sock,void *data,int len,int *fd);
+int fd_trusted(int sock);
+
+#endif
@@ -2,18 +2,75 @@
 #define GLOBAL
 
 #include <pthread.h>
+#include <time.h>
 
-struct BankAccount {
-    int accountN;
-    int balance;
-    pthread_rwlock_t lock;
+#include "account.h"
+#include "arena.h"
+#include "linebuffer.h"
+#include "uring.h"
+
+#define MAXTHREADS 10 // the amount of threads we want to create
+#define QLEN 5 // the queue length for a singular socket, also the most sessions a desk will take on
+#define MAX_LENGTH 100 // maximum input/output length, same as in client side
+#define SESSIONBUF 1024 // input buffered per session
+#define SHMCLIENT 2 // connection flag of a client asking for the shared-memory transport
+#define ADMINCLIENT 4 // connection flag of an operator's session, which may send the bulk commands
+
+struct CombSlot { // one desk's pending operation on a hot account
+    int op; // 'd' or 'w' while pending, 0 once applied
+    int result; // 1 if the operation went through, 0 if there was not enough money, -1 on overflow
+    long long amount;
+} __attribute__((aligned(64))); // keep every desk's slot on its own cache line
+
+struct Combiner { // publication list of a hot account, applied in batches by whoever holds the account
+    struct CombSlot slot[MAXTHREADS];
+    int batches; // number of combining passes
+    int applied; // operations applied in those passes
+};
+
+struct Session { // state of one client connection, reused from the desk's pool
+    int fd;
+    unsigned id; // session number in the capture, 0 when not capturing
+    int admin; // an operator's session, see ADMINCLIENT
+    struct linebuf lb; // incoming data, split into lines
+    char in[2 * SESSIONBUF]; // memory behind lb, room for a full read on top of a partial line
+    char line[MAX_LENGTH]; // the command being handled
+    char response[MAX_LENGTH]; // the reply to it
+    // the rest is only used by the io_uring backend, where a desk serves many sessions at once
+    int flag; // connection flag sent by the client
+    struct Session *prev, *next; // live sessions of the desk
+    int counted; // session takes up a slot in the desk queue
+    int flagArmed; // receive of the connection flag still pending
+    int recvArmed; // multishot receive still active
+    int paused; // receive cancelled because lb was full, resumes once the held data is in
+    int held, heldTail; // provided buffers that came in while lb was full, in order, -1 if none
+    int sending; // bytes of out handed to the kernel
+    int closing; // close once nothing is in flight
+    int outLen; // responses waiting in out
+    char out[SESSIONBUF];
 };
 
 struct ThreadData {
     int id;
-    int qSize;
+    int qSize; // sessions handed to this desk (queued + the one being served), never above QLEN
     pthread_mutex_t mutex;
-    char *path;
+    char path[16];
+    struct timespec queued[QLEN]; // hand-out times of the sessions still waiting in the queue
+    int qHead; // oldest waiting session in queued
+    int qCount; // number of waiting sessions in queued
+    int active; // client socket being served on the POSIX path, -1 if none
+    struct shmchan *shm; // shared-memory channel of the active session, NULL if none
+    int cut; // the drain time is up, the active session has to finish now
+    struct arena arena; // memory of this desk, the request path allocates nothing else
+    struct pool sessions; // Session objects
+    char *snap; // buffer for formatting the account details file
+    int snapSize;
+    struct uring *uring; // io_uring of the desk, NULL on the POSIX path
+    char *logBuf[2]; // log lines batched for the next io_uring append, one buffer can be in flight
+    int logLen[2];
+    int logCur; // buffer being filled
+    int logBusy; // an append is in flight
+    int dirty; // account details changed since the last save
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -26,6 +26,7 @@ struct linebuf *linebuf_new(void) {
     }
     lb->size = 2*LINESIZ;
     lb->end = 0;
+    lb->fixed = 0;
     return lb;
 }
 
@@ -38,6 +39,19 @@ void linebuf_free(struct linebuf *lb) {
     free(lb);
 }
 
+/**
+ * Set up a buffer on caller-owned memory. It never grows, so lines
+ * longer than the memory are an error.
+ * \param lb Linebuffer to set up.
+ * \param buf Memory for the data.
+ * \param size Size of buf. */
+void linebuf_init(struct linebuf *lb,char *buf,int size) {
+    lb->buf = buf;
+    lb->size = size;
+    lb->end = 0;
+    lb->fixed = 1;
+}
+
 /**
  * Read more data into the buffer.
  * \param lb Linebuffer to read to.
@@ -45,7 +59,9 @@ void linebuf_free(struct linebuf *lb) {
  * \return Number of bytes read, or -1 on error. 0 if EOF. */
 int linebuf_readdata(struct linebuf *lb,int fd) {
     if (lb == NULL) return -1;
-    if ((lb->size-lb->end) < LINESIZ) { // Too little buffer left, increase buffer size
+    if (lb->fixed) {
+        if (lb->end == lb->size) return -1; // Full without a complete line
+    } else if ((lb->size-lb->end) < LINESIZ) { // Too little buffer left, increase buffer size
         char *tmp = realloc(lb->buf,lb->size+LINESIZ);
         if (tmp == NULL) {
 //		printF("linebuf: realloc() failed\n");
@@ -80,3 +96,22 @@ char *linebuf_getline(struct linebuf *lb) {
     return NULL;
 }
 
+/**
+ * Try to read a line from the buffer into caller-owned memory.
+ * The line is NUL-terminated, and cut short if it doesn't fit.
+ * \param lb Linebuffer to read from.
+ * \param dst Where to copy the line, newline included.
+ * \param size Size of dst.
+ * \return Length of the copied line, or -1 if there is no complete line
+ * in the buffer. */
+int linebuf_copyline(struct linebuf *lb,char *dst,int size) {
+    char *nl = memchr(lb->buf,'\n',lb->end);
+    if (nl == NULL) return -1;
+    int len = nl-lb->buf+1;
+    int n = len < size ? len : size-1;
+    memcpy(dst,lb->buf,n);
+    dst[n] = '\0';
+    lb->end -= len;  // Update size of rest of the data.
+    memmove(lb->buf,lb->buf+len,lb->end);  // Move contents of buffer
+    return n;
+}
@@ -5,11 +5,14 @@ struct linebuf {
     char *buf;	// Allocated buffer.
     int size;	// Size of allocated buffer.
     int end;	// Amount of data in the buffer.
+    int fixed;	// Buffer is owned by the caller and never reallocated.
 };
 
 struct linebuf *linebuf_new(void);
 void linebuf_free(struct linebuf *lb);
 int linebuf_readdata(struct linebuf *lb,int fd);
 char *linebuf_getline(struct linebuf *lb);
+void linebuf_init(struct linebuf *lb,char *buf,int size);
+int linebuf_copyline(struct linebuf *lb,char *dst,int size);
 
 #endif
@@ -0,0 +1,487 @@
+/**
+ * Replay a capture taken with server3 -c against a running bank.
+ *
+ * Every captured session gets a thread of its own that connects when the
+ * session first sent something and sends its command lines in the
+ * original order, each one waiting for the reply to the one before, at
+ * the original pace, N times faster or as fast as the bank allows. A
+ * command also waits until the commands on its accounts that ended
+ * before it in the captured run are done, so every account goes through
+ * the same history and each reply is compared with the captured one; a
+ * session that has to wait leaves its desk meanwhile. At the end the
+ * balances are compared with the snapshot taken when the captured run
+ * closed.
+ *
+ * Two commands on an account that ran at the same time in the captured
+ * run may come out the other way round, say two withdrawals with money
+ * for only one of them. Differences on such an account, and on accounts
+ * its changed transfers reach, are counted apart and don't fail the
+ * replay.
+ *
+ *   replay3 -s account_details.txt capture.bin   seed a test bank with the starting accounts
+ *   replay3 [-x speed] capture.bin              replay, speed 1 is real time and 0 no waiting
+ */
+
+#define _POSIX_C_SOURCE 202009L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "capture.h"
+#include "command.h"
+
+#define MAX_LENGTH 100 // max length for input and output
+#define BUSY_MS 10 // wait before asking again after a busy reply
+
+struct account {
+    int number;
+    int raced;               // Two of its commands ran at the same time in the captured run.
+    int differs;             // A command on it came out differently after a race (1) or not (2), later ones may as well.
+};
+
+struct step {
+    struct caprec *r;        // The command, its captured reply after the line.
+    struct step *after[2];   // Commands on the same accounts that ended before it in the captured run.
+    struct account *acc[2];  // Accounts it touches, NULL for none.
+    int raced;               // It ran at the same time as one of those commands.
+    int done;
+};
+
+struct session {
+    unsigned id;
+    int n,size;              // Commands, room in cmd.
+    struct step *cmd;        // Commands in order.
+    long long *lat;          // Latency of each command in nanoseconds.
+    int ok,fail,busy;        // Replies and busy retries.
+    pthread_t thread;
+};
+
+struct touch {               // an account a command touches, sorted to find each account's history
+    int number;
+    int slot;                // Which of the command's accounts it is.
+    struct step *s;
+};
+
+static struct session *sessions = NULL;
+static int numsessions = 0;
+static double speed = 1;            // Replay speed, 0 is as fast as possible.
+static struct timespec start;       // Start of the replay.
+static long long first = -1;        // Time of the first captured command.
+static pthread_mutex_t doneM = PTHREAD_MUTEX_INITIALIZER; // the done flags and the counts below
+static pthread_cond_t doneC = PTHREAD_COND_INITIALIZER;
+static int same = 0,raced = 0,differ = 0; // replies as captured, different after a race, different otherwise
+
+/**
+ * \return Nanoseconds since the replay started. */
+static long long elapsed(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (ts.tv_sec-start.tv_sec)*1000000000LL+ts.tv_nsec-start.tv_nsec;
+}
+
+/**
+ * Sleep until a captured moment comes around at the replay speed.
+ * \param ns Capture time. */
+static void waitFor(long long ns) {
+    if (speed <= 0) return;
+    long long due = (ns-first)/speed,now = elapsed();
+    if (due > now) {
+        struct timespec d = { (due-now)/1000000000LL,(due-now)%1000000000LL };
+        nanosleep(&d,NULL);
+    }
+}
+
+static int connectTo(const char *path) {
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if (fd == -1) return -1;
+    struct sockaddr_un a;
+    memset(&a,0,sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path,path,sizeof(a.sun_path)-1);
+    if (connect(fd,(struct sockaddr *)&a,sizeof(a)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Read one null-terminated reply, nothing else is in flight.
+ * \return Its length, -1 if the bank hung up. */
+static int readReply(int fd,char *buf,int size) {
+    int have = 0;
+    while (have == 0 || buf[have-1] != '\0') {
+        if (have == size) return -1;
+        int r = read(fd,buf+have,size-have);
+        if (r <= 0) return -1;
+        have += r;
+    }
+    return have-1;
+}
+
+/**
+ * Open a session at a desk of the bank, as client3 does.
+ * \param busy Incremented for every busy reply, from the bank or the desk.
+ * \return The desk socket, -1 if the bank is not there. */
+static int openSession(int *busy) {
+    char buf[MAX_LENGTH];
+    struct timespec nap = { 0,BUSY_MS*1000000L };
+    while (1) {
+        int fd = connectTo("unix_socket");
+        if (fd == -1) return -1;
+        int len = readReply(fd,buf,sizeof(buf));
+        close(fd);
+        if (len > 0 && strncmp(buf,"fail",4) != 0) {
+            int flag = 0;
+            if ((fd = connectTo(buf)) == -1) return -1;
+            if (write(fd,&flag,sizeof(flag)) != sizeof(flag) || readReply(fd,buf,sizeof(buf)) == -1) {
+                close(fd);
+                return -1;
+            }
+            if (strncmp(buf,"fail",4) != 0) return fd;
+            close(fd); // waited in the desk queue past the deadline, ask the bank again
+        }
+        (*busy)++;
+        nanosleep(&nap,NULL);
+    }
+}
+
+/**
+ * Check that the commands that went before a step on its accounts are done.
+ * \param wait Wait for them if not.
+ * \return 1 if they are, 0 if not and not waiting. */
+static int turn(struct step *c,int wait) {
+    pthread_mutex_lock(&doneM);
+    int ret;
+    while (!(ret = (c->after[0] == NULL || c->after[0]->done) && (c->after[1] == NULL || c->after[1]->done)) && wait) {
+        pthread_cond_wait(&doneC,&doneM);
+    }
+    pthread_mutex_unlock(&doneM);
+    return ret;
+}
+
+/**
+ * Compare a reply with the captured one and let the step's followers go.
+ * \param reply The reply, NULL if the command was never answered. */
+static void finish(struct session *s,struct step *c,const char *reply) {
+    const char *want = (const char *)(c->r+1)+c->r->len;
+    int len = reply != NULL ? (int)strcspn(reply,"\n") : -1,j;
+    pthread_mutex_lock(&doneM);
+    if (reply != NULL && ((unsigned)len != c->r->rlen || memcmp(reply,want,len) != 0)) {
+        int cause = c->raced ? 1 : 2;
+        for (j = 0; j < 2; j++) {
+            if (c->acc[j] != NULL && c->acc[j]->differs != 0 && c->acc[j]->differs < cause) cause = c->acc[j]->differs;
+        }
+        if (cause == 1) {
+            raced++;
+        } else if (differ++ < 5) {
+            printf("Session %u: %.*s replied %.*s, the captured run %.*s\n",s->id,
+                (int)c->r->len,(const char *)(c->r+1),len,reply,(int)c->r->rlen,want);
+        }
+        for (j = 0; j < 2; j++) { // its account may have ended up different, and a transfer carries that on
+            if (c->acc[j] != NULL && c->acc[j]->differs < cause) c->acc[j]->differs = cause;
+        }
+    } else if (reply != NULL) {
+        same++;
+    }
+    c->done = 1;
+    pthread_cond_broadcast(&doneC);
+    pthread_mutex_unlock(&doneM);
+}
+
+/**
+ * Play one session back.
+ * \param arg The session.
+ * \return NULL. */
+static void *replay(void *arg) {
+    struct session *s = arg;
+    char line[MAX_LENGTH+1],reply[REPLYSIZE];
+    waitFor(s->cmd[0].r->ns);
+    turn(&s->cmd[0],1);
+    int fd = openSession(&s->busy),i;
+    for (i = 0; fd != -1 && i < s->n; i++) {
+        struct step *c = &s->cmd[i];
+        int len = c->r->len < MAX_LENGTH ? c->r->len : MAX_LENGTH;
+        memcpy(line,c->r+1,len);
+        line[len++] = '\n';
+        waitFor(c->r->ns);
+        if (!turn(c,0)) { // give the desk back meanwhile, the session we wait for may be queued behind it
+            close(fd);
+            turn(c,1);
+            if ((fd = openSession(&s->busy)) == -1) break;
+        }
+        long long sent = elapsed();
+        if (write(fd,line,len) != len || readReply(fd,reply,sizeof(reply)) == -1) break;
+        s->lat[i] = elapsed()-sent;
+        if (strncmp(reply,"ok",2) == 0) s->ok++;
+        else s->fail++;
+        finish(s,c,reply);
+    }
+    if (fd == -1 || i < s->n) fprintf(stderr,"Session %u lost the bank after %d commands.\n",s->id,i);
+    int done = i;
+    for (; i < s->n; i++) { // the other sessions must not wait for them
+        finish(s,&s->cmd[i],NULL);
+    }
+    s->n = done;
+    if (fd != -1) close(fd);
+    return NULL;
+}
+
+/**
+ * Add a command to its session.
+ * \return 0 on success, -1 out of memory. */
+static int addCommand(struct caprec *r) {
+    int i;
+    for (i = numsessions-1; i >= 0 && sessions[i].id != r->session; i--); // sessions show up about in order
+    if (i < 0) {
+        struct session *n = realloc(sessions,(numsessions+1)*sizeof(struct session));
+        if (n == NULL) return -1;
+        sessions = n;
+        i = numsessions++;
+        memset(&sessions[i],0,sizeof(struct session));
+        sessions[i].id = r->session;
+    }
+    struct session *s = &sessions[i];
+    if (s->n == s->size) {
+        s->size = s->size ? 2*s->size : 16;
+        struct step *c = realloc(s->cmd,s->size*sizeof(struct step));
+        if (c == NULL) return -1;
+        s->cmd = c;
+    }
+    memset(&s->cmd[s->n],0,sizeof(struct step));
+    s->cmd[s->n++].r = r;
+    if (first == -1 || r->ns < first) first = r->ns;
+    return 0;
+}
+
+static int cmptouch(const void *a,const void *b) {
+    const struct touch *x = a,*y = b;
+    if (x->number != y->number) return x->number < y->number ? -1 : 1;
+    return x->s->r->end < y->s->r->end ? -1 : x->s->r->end > y->s->r->end;
+}
+
+/**
+ * Link every command to the ones that went before it on its accounts.
+ * \param total Number of commands.
+ * \param accs Set to the accounts, sorted by number.
+ * \return Number of accounts, -1 out of memory. */
+static int order(int total,struct account **accs) {
+    struct touch *t = malloc((2*total+1)*sizeof(struct touch));
+    struct account *a = malloc((2*total+1)*sizeof(struct account));
+    int n = 0,na = 0,i,j,k;
+    if (t == NULL || a == NULL) {
+        free(t);
+        free(a);
+        return -1;
+    }
+    for (i = 0; i < numsessions; i++) {
+        for (j = 0; j < sessions[i].n; j++) {
+            struct step *c = &sessions[i].cmd[j];
+            char line[MAX_LENGTH+1];
+            struct Command cmd;
+            int len = c->r->len < MAX_LENGTH ? c->r->len : MAX_LENGTH;
+            memcpy(line,c->r+1,len);
+            line[len] = '\0';
+            if (cmd_parse(line,&cmd) != 0 || cmd.cmd == '\0' || strchr("lwdt",cmd.cmd) == NULL) continue; // touches no account
+            t[n++] = (struct touch){ cmd.acc1,0,c };
+            if (cmd.cmd == 't' && cmd.acc2 != cmd.acc1) t[n++] = (struct touch){ cmd.acc2,1,c };
+        }
+    }
+    qsort(t,n,sizeof(struct touch),cmptouch);
+    for (k = 0; k < n; k++) {
+        struct step *c = t[k].s;
+        if (k == 0 || t[k].number != t[k-1].number) {
+            a[na++] = (struct account){ t[k].number,0,0 };
+        } else {
+            struct step *prev = t[k-1].s;
+            c->after[t[k].slot] = prev;
+            if (c->r->start < prev->r->end) { // they overlapped, which one changed the account first is unknown
+                c->raced = prev->raced = 1;
+                a[na-1].raced = 1;
+            }
+        }
+        c->acc[t[k].slot] = &a[na-1];
+    }
+    free(t);
+    *accs = a;
+    return na;
+}
+
+static int cmpll(const void *a,const void *b) {
+    long long x = *(const long long *)a,y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmpacc(const void *a,const void *b) {
+    const struct account *x = a,*y = b;
+    return x->number < y->number ? -1 : x->number > y->number;
+}
+
+/**
+ * Compare the bank's balances with a snapshot, over one session.
+ * \param accs Accounts of the replayed commands, sorted by number.
+ * \return Number of accounts that differ other than by a race, -1 if the bank is not there. */
+static int check(const char *snap,int len,struct account *accs,int numaccs) {
+    int busy = 0,fd = openSession(&busy),bad = 0,total = 0,excused = 0;
+    if (fd == -1) return -1;
+    const char *p = snap,*end = snap+len;
+    char line[MAX_LENGTH],reply[REPLYSIZE];
+    while (p < end) {
+        int acc,n;
+        long long want,got = 0;
+        if (sscanf(p,"%d - %lld",&acc,&want) != 2) break;
+        n = sprintf(line,"l %d\n",acc);
+        if (write(fd,line,n) != n || readReply(fd,reply,sizeof(reply)) == -1) {
+            bad = -1;
+            break;
+        }
+        if (sscanf(reply,"ok: Balance of account %*d: %lld",&got) != 1 || got != want) {
+            struct account key = { acc,0,0 },*a = bsearch(&key,accs,numaccs,sizeof(struct account),cmpacc);
+            if (a != NULL && a->differs != 2 && (a->raced || a->differs == 1)) {
+                excused++;
+            } else {
+                if (bad < 5) printf("Account %d: %lld, the captured run ended with %lld\n",acc,got,want);
+                bad++;
+            }
+        }
+        total++;
+        p = memchr(p,'\n',end-p);
+        if (p == NULL) break;
+        p++;
+    }
+    close(fd);
+    if (bad >= 0) printf("%d of %d balances match the captured run, %d differ after a race in it\n",total-bad-excused,total,excused);
+    return bad;
+}
+
+int main(int argc,char *argv[]) {
+    char *seed = NULL;
+    int opt;
+    while ((opt = getopt(argc,argv,"x:s:")) != -1) {
+        switch (opt) {
+        case 'x': speed = atof(optarg); break;
+        case 's': seed = optarg; break;
+        default:
+            fprintf(stderr,"Usage: %s [-x speed] [-s starting_snapshot] capture_file\n",argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc-1) {
+        fprintf(stderr,"Usage: %s [-x speed] [-s starting_snapshot] capture_file\n",argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[optind],"rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data,1,size,f) != (size_t)size || size < (long)sizeof(int) || *(int *)data != CAPMAGIC) {
+        fprintf(stderr,"%s is not a capture file.\n",argv[optind]);
+        return 1;
+    }
+    fclose(f);
+
+    struct caprec *snap[2] = { NULL,NULL }; // start and end
+    long pos = sizeof(int);
+    int total = 0;
+    while (pos+(long)sizeof(struct caprec) <= size) {
+        struct caprec *r = (struct caprec *)(data+pos);
+        if (pos+(long)sizeof(*r)+r->len+r->rlen > size) break; // cut short, the bank did not close properly
+        pos += sizeof(*r)+r->len+r->rlen;
+        if (r->session == CAPSNAPSHOT) {
+            snap[snap[0] != NULL] = r;
+        } else if (addCommand(r) != 0) {
+            fprintf(stderr,"Out of memory.\n");
+            return 1;
+        } else {
+            total++;
+        }
+    }
+
+    if (seed != NULL) { // the test bank has to start from the same accounts
+        FILE *o = fopen(seed,"w");
+        if (o == NULL || snap[0] == NULL || fwrite(snap[0]+1,1,snap[0]->len,o) != snap[0]->len || fclose(o) != 0) {
+            fprintf(stderr,"Error writing the starting snapshot.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    long long last = first;
+    int i;
+    for (i = 0; i < numsessions; i++) {
+        struct session *s = &sessions[i];
+        if ((s->lat = calloc(s->n,sizeof(long long))) == NULL) {
+            fprintf(stderr,"Out of memory.\n");
+            return 1;
+        }
+        if (s->cmd[s->n-1].r->ns > last) last = s->cmd[s->n-1].r->ns;
+    }
+    struct account *accs;
+    int numaccs = order(total,&accs);
+    if (numaccs == -1) {
+        fprintf(stderr,"Out of memory.\n");
+        return 1;
+    }
+    printf("Replaying %d commands of %d sessions, %.2f s in the captured run\n",total,numsessions,(last-first)/1e9);
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (i = 0; i < numsessions; i++) {
+        if (pthread_create(&sessions[i].thread,NULL,replay,&sessions[i]) != 0) {
+            fprintf(stderr,"Error creating a session thread.\n");
+            return 1;
+        }
+    }
+    int ok = 0,fail = 0,busy = 0,done = 0;
+    for (i = 0; i < numsessions; i++) {
+        pthread_join(sessions[i].thread,NULL);
+        ok += sessions[i].ok;
+        fail += sessions[i].fail;
+        busy += sessions[i].busy;
+    }
+    double secs = elapsed()/1e9;
+
+    long long *lat = malloc((total > 0 ? total : 1)*sizeof(long long));
+    if (lat == NULL) {
+        fprintf(stderr,"Out of memory.\n");
+        return 1;
+    }
+    for (i = 0; i < numsessions; i++) {
+        memcpy(lat+done,sessions[i].lat,sessions[i].n*sizeof(long long));
+        done += sessions[i].n;
+    }
+    qsort(lat,done,sizeof(long long),cmpll);
+    printf("Replayed %d commands in %.2f s, %.0f commands/s, %d ok, %d fail, %d busy replies\n",
+        done,secs,secs > 0 ? done/secs : 0,ok,fail,busy);
+    if (done > 0) {
+        printf("Latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+            lat[done/2]/1e3,lat[(long long)done*9/10]/1e3,lat[(long long)done*99/100]/1e3,lat[done-1]/1e3);
+    }
+    printf("%d replies match the captured run, %d differ after a race in it, %d differ\n",same,raced,differ);
+
+    int ret = done < total || differ > 0;
+    if (snap[1] != NULL) {
+        int bad = check((char *)(snap[1]+1),snap[1]->len,accs,numaccs);
+        if (bad != 0) ret = 1;
+    } else {
+        printf("No closing snapshot in the capture, balances not checked\n");
+    }
+    for (i = 0; i < numsessions; i++) {
+        free(sessions[i].cmd);
+        free(sessions[i].lat);
+    }
+    free(sessions);
+    free(accs);
+    free(lat);
+    free(data);
+    return ret;
+}
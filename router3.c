@@ -0,0 +1,544 @@
+/*
+ * Cluster router: several server3 nodes behind one bank socket.
+ *
+ * Every node runs in a directory of its own (node0, node1, ...) with its
+ * own sockets, log and account details, and owns some of the NUMBUCKETS
+ * hash buckets of account numbers. Clients connect to unix_socket just as
+ * to a single server. Commands on one account go to the node owning it,
+ * transfers between nodes are carried out as a two-phase commit, bulk
+ * changes go to every node, and "m bucket node" moves a bucket to another
+ * node while the bank stays open.
+ */
+#define _XOPEN_SOURCE 700 // realpath
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include "global.h"
+#include "command.h"
+#include "linebuffer.h"
+#include "fdpass.h"
+
+#define MAXNODES 16
+#define POOLSIZE 4 // connections to each node, a POSIX node has MAXTHREADS desks to spare
+#define DESKPATH "unix_socket_r" // where clients go after the main socket, all sessions share it
+#define MAPFILE "bucket_map.txt" // which node owns which bucket, rewritten after every move
+#define STARTUP_MS 5000 // how long a node may take to open
+#define SESSIONBUF 1024 // client input buffer
+
+struct NodeConn { // one connection to a desk of a node
+    int fd; // -1 until (re)connected
+    struct NodeConn *next; // next free connection
+};
+
+struct Node {
+    pid_t pid;
+    char dir[16]; // working directory of the node
+    struct NodeConn conn[POOLSIZE];
+    struct NodeConn *free; // connections nobody is using
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // signalled when a connection is given back
+};
+
+struct Node nodes[MAXNODES];
+int numNodes = 2; // can be changed with -n
+int owner[NUMBUCKETS]; // node of every bucket
+pthread_rwlock_t bucketLock[NUMBUCKETS]; // commands hold their buckets for reading, a move holds its bucket for writing
+pthread_mutex_t moveM; // one move at a time
+int nextTx; // transaction number of the next transfer between nodes
+int logFd = -1; // log of the replies the router gives out
+volatile sig_atomic_t routerIsOpen = 1;
+const char errMsg[] = "fail: Error in command\n";
+const char downMsg[] = "fail: Node unavailable\n";
+
+void stop(int sig) {
+    (void)sig;
+    routerIsOpen = 0;
+}
+
+int connectTo(const char *path) { // connect to a unix socket, returns -1 on failure
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&a, sizeof(a)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int readReply(int fd, char *buf, int size) { // read one null-terminated reply, returns its length or -1
+    int have = 0;
+    while (have == 0 || buf[have - 1] != '\0') { // one request at a time, so nothing follows the null
+        if (have == size) {
+            return -1;
+        }
+        int r = read(fd, buf + have, size - have);
+        if (r <= 0) {
+            return -1;
+        }
+        have += r;
+    }
+    return have - 1;
+}
+
+int writeAll(int fd, const char *buf, int len) {
+    while (len > 0) {
+        int w = write(fd, buf, len);
+        if (w <= 0) {
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int nodeConnect(int n) { // open a session on one of the node's desks, returns the socket or -1
+    char path[2 * MAX_LENGTH], buf[MAX_LENGTH];
+    sprintf(path, "%s/unix_socket", nodes[n].dir);
+    int fd = connectTo(path);
+    if (fd == -1) {
+        return -1;
+    }
+    int len = readReply(fd, buf, sizeof(buf)); // the desk to go to, or busy
+    close(fd);
+    if (len <= 0 || strncmp(buf, "fail", 4) == 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", nodes[n].dir, buf);
+    if ((fd = connectTo(path)) == -1) {
+        return -1;
+    }
+    int flag = 0; // a plain socket session
+    if (writeAll(fd, (char *)&flag, sizeof(flag)) == -1 || readReply(fd, buf, sizeof(buf)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ask(int n, const char *line, char *reply) { // send a command line to a node and wait for the reply, returns its length
+    struct Node *nd = &nodes[n];
+    pthread_mutex_lock(&nd->mutex);
+    while (nd->free == NULL) {
+        pthread_cond_wait(&nd->cond, &nd->mutex);
+    }
+    struct NodeConn *c = nd->free;
+    nd->free = c->next;
+    pthread_mutex_unlock(&nd->mutex);
+
+    if (c->fd == -1) {
+        c->fd = nodeConnect(n);
+    }
+    int len = -1;
+    if (c->fd != -1 && writeAll(c->fd, line, strlen(line)) == 0) {
+        len = readReply(c->fd, reply, REPLYSIZE);
+    }
+    if (len == -1) { // the node may have carried it out, only commits and aborts are safe to send again; reconnect next time
+        if (c->fd != -1) {
+            close(c->fd);
+            c->fd = -1;
+        }
+        strcpy(reply, downMsg);
+        len = sizeof(downMsg) - 1;
+    }
+
+    pthread_mutex_lock(&nd->mutex);
+    c->next = nd->free;
+    nd->free = c;
+    pthread_cond_signal(&nd->cond);
+    pthread_mutex_unlock(&nd->mutex);
+    return len;
+}
+
+int isOk(const char *reply) {
+    return strncmp(reply, "ok", 2) == 0;
+}
+
+int isDown(const char *reply) { // the reply was lost, the command may or may not have been carried out
+    return strcmp(reply, downMsg) == 0;
+}
+
+void settle(int n, char op, int tx) { // commit or abort a prepared side, repeated until the node answers
+    char l[MAX_LENGTH], r[REPLYSIZE];
+    struct timespec nap = { 0, 10000000 };
+    sprintf(l, "%c %d\n", op, tx);
+    while (ask(n, l, r) > 0 && isDown(r)) { // neither can fail on the node, a repeat of one done already gets "Unknown transaction"
+        if (!routerIsOpen) { // the node keeps it in its pending file
+            fprintf(stderr, "Transaction %d is still prepared on node %d.\n", tx, n);
+            return;
+        }
+        nanosleep(&nap, NULL);
+        if (nap.tv_nsec < 500000000) {
+            nap.tv_nsec *= 2;
+        }
+    }
+}
+
+int transfer(struct Command *c, int from, int to, char *reply) { // two-phase transfer between two nodes, returns the reply length
+    int tx = __atomic_fetch_add(&nextTx, 1, __ATOMIC_RELAXED);
+    char l[MAX_LENGTH];
+    if (c->amount == LLONG_MIN) { // can't be negated for the paying side
+        strcpy(reply, errMsg);
+        return sizeof(errMsg) - 1;
+    }
+    sprintf(l, "p %d %d %lld\n", tx, c->acc1, -c->amount); // the paying side holds the money back
+    int len = ask(from, l, reply);
+    if (isDown(reply)) { // it may hold the money all the same
+        settle(from, 'a', tx);
+    }
+    if (!isOk(reply)) { // not enough money, the node's reply says so already
+        return len;
+    }
+    sprintf(l, "p %d %d %lld\n", tx, c->acc2, c->amount); // the receiving side keeps room for it
+    len = ask(to, l, reply);
+    if (!isOk(reply)) { // nothing is committed yet, undo whatever was prepared
+        if (isDown(reply)) {
+            settle(to, 'a', tx);
+        }
+        settle(from, 'a', tx);
+        return len;
+    }
+    settle(to, 'c', tx); // both sides are prepared, so the transfer happens
+    settle(from, 'c', tx);
+    return cmd_reply(c, RES_OK, 0, reply);
+}
+
+int bulk(struct Command *c, char *line, char *reply) { // a bulk change on every node, returns the reply length
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n, changed, skipped;
+    for (n = 0; n < numNodes; n++) {
+        ask(n, line, reply);
+        char *to = strstr(reply, " to ");
+        if (!isOk(reply) || to == NULL || sscanf(to, " to %d accounts, %d skipped", &changed, &skipped) != 2) {
+            return strlen(reply); // nodes already done keep their change
+        }
+        c->changed += changed;
+        c->skipped += skipped;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    c->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return cmd_reply(c, RES_OK, 0, reply);
+}
+
+void saveMap() { // write the bucket map, a restarted router picks it up again
+    FILE *f = fopen(MAPFILE, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error writing the bucket map.\n");
+        return;
+    }
+    for (int b = 0; b < NUMBUCKETS; b++) {
+        fprintf(f, "%d - %d\n", b, owner[b]);
+    }
+    fclose(f);
+}
+
+void loadMap() { // contiguous ranges of buckets per node, unless a map has been saved for this many nodes
+    int b, n;
+    for (b = 0; b < NUMBUCKETS; b++) {
+        owner[b] = b * numNodes / NUMBUCKETS;
+    }
+    FILE *f = fopen(MAPFILE, "r");
+    if (f == NULL) {
+        return;
+    }
+    int saved[NUMBUCKETS], count = 0;
+    while (fscanf(f, "%d - %d", &b, &n) == 2 && b >= 0 && b < NUMBUCKETS && n >= 0 && n < numNodes) {
+        saved[b] = n;
+        count++;
+    }
+    fclose(f);
+    if (count == NUMBUCKETS) {
+        memcpy(owner, saved, sizeof(owner));
+    }
+}
+
+int moveBucket(int b, int to, char *reply) { // move a locked bucket, returns the reply length
+    int from = owner[b], count = 0, len;
+    char l[MAX_LENGTH], r[REPLYSIZE];
+    if (from == to) {
+        return snprintf(reply, REPLYSIZE, "ok: Bucket %d is on node %d already\n", b, to);
+    }
+    sprintf(l, "e %d\n", b);
+    len = ask(from, l, reply);
+    if (!isOk(reply)) {
+        return len;
+    }
+    sscanf(reply, "ok: Exported %d", &count);
+    sprintf(l, "g %d\n", b);
+    len = ask(to, l, reply);
+    if (isOk(reply)) {
+        owner[b] = to;
+        saveMap();
+        len = snprintf(reply, REPLYSIZE, "ok: Moved bucket %d from node %d to node %d, %d accounts\n", b, from, to, count);
+    } else if (ask(from, l, r) >= 0 && !isOk(r)) { // not even back where it came from, leave the file for someone to look at
+        fprintf(stderr, "Bucket %d is left in " BUCKETFILE ": %s", b, b, r);
+        return len;
+    }
+    sprintf(l, BUCKETFILE, b);
+    unlink(l);
+    return len;
+}
+
+int move(char *line, char *reply) { // the m command, returns the reply length
+    int b, to;
+    if (sscanf(line, "m %d %d", &b, &to) != 2 || line[1] != ' ' || b < 0 || b >= NUMBUCKETS || to < 0 || to >= numNodes) {
+        strcpy(reply, errMsg);
+        return sizeof(errMsg) - 1;
+    }
+    pthread_mutex_lock(&moveM);
+    pthread_rwlock_wrlock(&bucketLock[b]); // waits for the commands already on the bucket, holds back new ones
+    int len = moveBucket(b, to, reply);
+    pthread_rwlock_unlock(&bucketLock[b]);
+    pthread_mutex_unlock(&moveM);
+    return len;
+}
+
+int route(char *line, char *reply, int admin) { // carry out one client command line, admin for an operator's session, returns the reply length
+    if (line[0] == 'm') {
+        return move(line, reply);
+    }
+    struct Command c;
+    if (cmd_parse(line, &c) != 0) {
+        strcpy(reply, errMsg);
+        return sizeof(errMsg) - 1;
+    }
+    strcat(line, "\n"); // cut off by cmd_parse, the nodes want it back
+    int b1 = cmd_bucket(c.acc1), b2 = cmd_bucket(c.acc2), len, b;
+    switch (c.cmd) {
+        case 'l':
+        case 'w':
+        case 'd':
+            pthread_rwlock_rdlock(&bucketLock[b1]);
+            len = ask(owner[b1], line, reply);
+            pthread_rwlock_unlock(&bucketLock[b1]);
+            return len;
+        case 't': { // lock both buckets in order, so a move can't wait on itself
+            int lo = b1 < b2 ? b1 : b2, hi = b1 < b2 ? b2 : b1;
+            pthread_rwlock_rdlock(&bucketLock[lo]);
+            if (hi != lo) {
+                pthread_rwlock_rdlock(&bucketLock[hi]);
+            }
+            if (owner[b1] == owner[b2]) {
+                len = ask(owner[b1], line, reply);
+            } else {
+                len = transfer(&c, owner[b1], owner[b2], reply);
+            }
+            if (hi != lo) {
+                pthread_rwlock_unlock(&bucketLock[hi]);
+            }
+            pthread_rwlock_unlock(&bucketLock[lo]);
+            return len;
+        }
+        case 'i':
+        case 'f': // no move may be half way through
+            if (!admin) { // only operators change every account
+                c.cmd = '?';
+                return cmd_reply(&c, RES_OK, 0, reply);
+            }
+            for (b = 0; b < NUMBUCKETS; b++) {
+                pthread_rwlock_rdlock(&bucketLock[b]);
+            }
+            len = bulk(&c, line, reply);
+            for (b = 0; b < NUMBUCKETS; b++) {
+                pthread_rwlock_unlock(&bucketLock[b]);
+            }
+            return len;
+        case 'q':
+            return cmd_reply(&c, RES_OK, 0, reply);
+        default: // the node commands are not for clients
+            c.cmd = '?';
+            return cmd_reply(&c, RES_OK, 0, reply);
+    }
+}
+
+void *session(void *arg) { // serve one client until it hangs up
+    int fd = (int)(long)arg;
+    int flag;
+    char in[SESSIONBUF], line[MAX_LENGTH + 1], reply[REPLYSIZE];
+    struct linebuf lb;
+    linebuf_init(&lb, in, sizeof(in));
+    // clients asking for shared memory get a ready without a descriptor and stay on the socket
+    if (read(fd, &flag, sizeof(flag)) == sizeof(flag) && writeAll(fd, "ready\n", 7) == 0) {
+        int admin = (flag & ADMINCLIENT) && fd_trusted(fd); // anyone else gets a plain session
+        while (linebuf_readdata(&lb, fd) > 0) {
+            while (linebuf_copyline(&lb, line, MAX_LENGTH - 1) >= 0) {
+                int len = route(line, reply, admin);
+                if (write(logFd, reply, len) == -1) {
+                    fprintf(stderr, "Error appending to the log file.\n");
+                }
+                if (writeAll(fd, reply, len + 1) == -1) {
+                    break;
+                }
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int listenOn(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd != -1);
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&a, sizeof(a)) == -1 || listen(fd, 64) == -1) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+int startNode(int n, const char *server, int uring) { // fork a node in its directory and open its connections
+    struct Node *nd = &nodes[n];
+    sprintf(nd->dir, "node%d", n);
+    if (mkdir(nd->dir, 0755) == -1 && errno != EEXIST) {
+        perror(nd->dir);
+        return -1;
+    }
+    pthread_mutex_init(&nd->mutex, NULL);
+    pthread_cond_init(&nd->cond, NULL);
+    if ((nd->pid = fork()) == 0) {
+        int out = open("/dev/null", O_WRONLY); // a server echoes everything its clients send
+        if (chdir(nd->dir) == -1 || out == -1 || dup2(out, STDOUT_FILENO) == -1) {
+            _exit(1);
+        }
+        execl(server, "server3", "-n", uring ? "-u" : NULL, (char *)NULL); // -n lets the node take the cluster commands
+        perror(server);
+        _exit(1);
+    }
+    if (nd->pid == -1) {
+        return -1;
+    }
+    struct timespec nap = { 0, 20000000 };
+    int i, waited = 0;
+    for (i = 0; i < POOLSIZE; i++) {
+        while ((nd->conn[i].fd = nodeConnect(n)) == -1) {
+            if (waited >= STARTUP_MS) {
+                fprintf(stderr, "Node %d did not open.\n", n);
+                return -1;
+            }
+            nanosleep(&nap, NULL);
+            waited += 20;
+        }
+        nd->conn[i].next = nd->free;
+        nd->free = &nd->conn[i];
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *server = "./server3";
+    int opt, uring = 0;
+    while ((opt = getopt(argc, argv, "n:s:u")) != -1) {
+        switch (opt) {
+            case 'n': numNodes = atoi(optarg); break; // how many nodes
+            case 's': server = optarg; break; // server binary
+            case 'u': uring = 1; break; // nodes run their desks on io_uring
+            default:
+                fprintf(stderr, "Usage: %s [-n nodes] [-s server] [-u]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (numNodes < 1 || numNodes > MAXNODES) {
+        fprintf(stderr, "Between 1 and %d nodes.\n", MAXNODES);
+        return 1;
+    }
+    char serverPath[PATH_MAX];
+    if (realpath(server, serverPath) == NULL) { // the nodes run in other directories
+        perror(server);
+        return 1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); // a node gone away shows up as a failed write
+    nextTx = (int)(time(NULL) & 0xffff) << 14; // numbers of an earlier run may still be prepared on some node
+
+    loadMap();
+    saveMap();
+    for (int b = 0; b < NUMBUCKETS; b++) {
+        pthread_rwlock_init(&bucketLock[b], NULL);
+    }
+    pthread_mutex_init(&moveM, NULL);
+    logFd = open("log.txt", O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    if (logFd == -1) {
+        fprintf(stderr, "Error in opening or creating an empty log file.\n");
+        return 1;
+    }
+    int n;
+    for (n = 0; n < numNodes; n++) {
+        if (startNode(n, serverPath, uring) == -1) {
+            numNodes = n + 1;
+            routerIsOpen = 0;
+            break;
+        }
+    }
+
+    struct pollfd p[2] = { { listenOn("unix_socket"), POLLIN, 0 }, { listenOn(DESKPATH), POLLIN, 0 } };
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (routerIsOpen) {
+        if (poll(p, 2, -1) <= 0) { // a signal, most likely
+            continue;
+        }
+        if (p[0].revents & POLLIN) { // every client is sent to the same place
+            int fd = accept(p[0].fd, NULL, NULL);
+            if (fd != -1) {
+                writeAll(fd, DESKPATH, sizeof(DESKPATH));
+                close(fd);
+            }
+        }
+        if (p[1].revents & POLLIN) {
+            int fd = accept(p[1].fd, NULL, NULL);
+            pthread_t t;
+            if (fd != -1 && pthread_create(&t, &attr, session, (void *)(long)fd) != 0) {
+                close(fd);
+            }
+        }
+    }
+
+    close(p[0].fd);
+    close(p[1].fd);
+    unlink("unix_socket");
+    unlink(DESKPATH);
+    for (n = 0; n < numNodes; n++) { // the nodes drain their desks and save as usual
+        if (nodes[n].pid > 0) {
+            kill(nodes[n].pid, SIGINT);
+        }
+    }
+    for (n = 0; n < numNodes; n++) {
+        if (nodes[n].pid > 0) {
+            waitpid(nodes[n].pid, NULL, 0);
+        }
+    }
+    close(logFd);
+    return 0;
+}
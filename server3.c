@@ -10,273 +10,656 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
 
 #include "global.h"
+#include "command.h"
+#include "fdpass.h"
+#include "shmring.h"
+#include "trace.h"
+#include "capture.h"
 
-#define MAXTHREADS 10 // the amount of threads we want to create
-#define QLEN 5 // the queue length length for a singular socket
-#define MAX_LENGTH 100 // maximum input/output length, same as in client side
+#define DEADLINE_MS 2000 // default time a session may wait in a desk queue before it is turned away
+#define ARENASIZE 16384 // first arena block of every worker
+#define HOTLIMIT 64 // contended write locks before an account switches to combining
+#define MAXCOMB 16 // how many accounts can be in combining mode at once
+#define URINGSIZE 256 // submission queue entries of a desk's io_uring
+#define NUMBUFS 64 // provided receive buffers per desk
+#define LOGBUF 8192 // log batch buffer of an io_uring desk
+#define PEERCHECK_MS 1000 // idle time after which a shared-memory desk checks that its client is still there
+#define TRACEFILE "trace.bin" // where the trace rings are dumped at shutdown
+#define DRAIN_MS 1000 // default time sessions get to finish at shutdown or hand-over before they are cut off
+#define CTLPATH "unix_socket_ctl" // control socket, a new process asks here to take over
+#define HANDOVER 3 // control request of a new process that takes over the listening sockets
+#define NUMLISTENERS (MAXTHREADS + 2) // main socket, control socket, then one per desk
+#define MAXPENDING 256 // prepared sides of cross-node transfers a node holds at once
+#define PENDINGFILE "pending.txt" // prepared sides, so they outlive a restart like the balances do
 
-struct BankAccount *accounts = NULL; // empty list of accounts (account number, balance, read/write lock)
-int num_accounts; // number of accounts
 struct ThreadData thread_data[MAXTHREADS]; // list of threads' data (id, queue size, mutex)
 pthread_t threads[MAXTHREADS]; // list of threads to join them later
 int bankIsOpen = 1; // to use for graceful shutdown
 pthread_mutex_t logM; // logger mutex
+pthread_mutex_t saveM; // account details file mutex
+int logFd = -1; // log file, kept open for the whole run
+int accFd = -1; // account details file, kept open for the whole run
+_Thread_local struct ThreadData *desk = NULL; // the worker (desk or main) running on this thread
+struct ThreadData mainWorker; // worker data of the main thread
+const char errMsg[] = "fail: Error in command\n";
+int deadline = DEADLINE_MS; // queue deadline in milliseconds, can be changed with -d
+int shedCount = 0; // how many clients have been turned away with a busy reply
+pthread_mutex_t shedM; // shed counter mutex
+char *busyMsg = "fail: busy\n"; // reply for clients we cannot serve in time
+int useUring = 0; // desks run on io_uring instead of blocking calls, set with -u
+struct Combiner combiners[MAXCOMB]; // combiners handed out to hot accounts, never taken back
+int num_comb = 0; // combiners in use
+pthread_mutex_t combM; // combiner hand-out mutex
+int wakeFd = -1; // eventfd that becomes readable when the desks should stop taking sessions
+int grace = DRAIN_MS; // drain time in milliseconds, can be changed with -g
+int desksOpen = 0; // desk threads still running
+int desksStarted = 0; // desk threads have been created, a taking-over process waits for its predecessor first
+int successor = -1; // control connection to the process taking over from us
+struct Pending { // one prepared side of a cross-node transfer
+    int tx; // transaction number given by the router
+    int slot; // account slot
+    long long amount; // negative on the paying side, where it has already been taken off the balance
+} pending[MAXPENDING];
+int numPending = 0; // prepared sides waiting for a commit or abort
+int aborted[MAXPENDING]; // transactions aborted before their prepare arrived, which is then refused
+int numAborted = 0; // aborts recorded so far, the oldest are overwritten
+pthread_mutex_t pendM; // pending table mutex
+int pendFd = -1; // pending file, kept open for the whole run
+int nodeMode = 0; // running as a node of router3, which takes the cluster commands; set with -n
 
-void toLog(char *string, pthread_mutex_t mut) { // logging function
-    FILE *fp = fopen("log.txt", "a"); // if there is a log file, just append
-    if (fp == NULL) { // if append-open failed
+void toLog(char *string, pthread_mutex_t *mut) { // logging function
+    if (desk != NULL && desk->uring != NULL) { // io_uring desks append a whole batch of lines at once
+        int len = strlen(string);
+        if (desk->logLen[desk->logCur] + len <= LOGBUF) {
+            memcpy(desk->logBuf[desk->logCur] + desk->logLen[desk->logCur], string, len);
+            desk->logLen[desk->logCur] += len;
+            return;
+        }
+    }
+    int ret = pthread_mutex_trylock(mut);
+    while (ret == EBUSY) { // try to acquire the lock until it succeeds
+        ret = pthread_mutex_trylock(mut);
+    }
+    assert(ret == 0);
+    if (write(logFd, string, strlen(string)) == -1) { // the log file stays open, appends go straight to it
         fprintf(stderr, "Error appending to the log file.\n");
-        return;
-    } else { // otherwise append
-        int ret = pthread_mutex_trylock(&mut);
-        while (ret == EBUSY) { // try to acquire the lock until it succeeds
-            ret = pthread_mutex_trylock(&mut);
+    }
+    pthread_mutex_unlock(mut);
+}
+
+void writeAccDetails() { // write accounts' details to the file
+    int n = __atomic_load_n(&num_accounts, __ATOMIC_ACQUIRE);
+    int need = n * SNAPLINE;
+    if (desk->snapSize < need) { // grow the snapshot buffer, only happens when new accounts show up
+        int size = desk->snapSize > 0 ? desk->snapSize : 64 * SNAPLINE;
+        while (size < need) {
+            size *= 2;
+        }
+        char *snap = arena_alloc(&desk->arena, size);
+        if (snap == NULL) {
+            fprintf(stderr, "Error saving the account details.\n");
+            return;
         }
-        assert(ret == 0);
-        fprintf(fp, "%s", string);
-        fclose(fp);
-        pthread_mutex_unlock(&mut);
+        desk->snap = snap;
+        desk->snapSize = size;
     }
+    long long t = trace_begin();
+    int len = acc_format(desk->snap, 0, n); // format the information for each account into the buffer
+    pthread_mutex_lock(&saveM); // one writer at a time, the file is rewritten from the start
+    if (pwrite(accFd, desk->snap, len, 0) != len || ftruncate(accFd, len) != 0) {
+        fprintf(stderr, "Error writing the account details file.\n");
+    }
+    pthread_mutex_unlock(&saveM);
+    trace_end(SPAN_PERSIST, t);
 }
 
 void saveAccDetails() { // save accounts' details
-    FILE *file = fopen("account_details.txt", "w"); // open file in write mode, creates one if it doesn't exist
-    if (file == NULL) { // check if it worked
-        fprintf(stderr, "Error opening the account details file.\n");
+    if (desk->uring != NULL) { // io_uring desks save once per batch of completions
+        desk->dirty = 1;
         return;
     }
-    int i;
-    for (i = 0; i < num_accounts; i++) { // update the information for each account into the file
-        fprintf(file, "%d - %d\n", accounts[i].accountN, accounts[i].balance);
+    writeAccDetails();
+}
+
+void makeHot(int idx) { // switch an account to combining mode
+    pthread_mutex_lock(&combM);
+    if (ACCLOCK(idx).comb == -1 && num_comb < MAXCOMB) { // someone else may have beaten us to it
+        memset(&combiners[num_comb], 0, sizeof(struct Combiner));
+        __atomic_store_n(&ACCLOCK(idx).comb, num_comb, __ATOMIC_RELEASE); // publish only after the slots are clear
+        num_comb++;
+        char l[MAX_LENGTH];
+        sprintf(l, "Account %d is now combining\n", ACCNUMBER(idx));
+        toLog(l, &logM);
     }
-    fclose(file);
+    pthread_mutex_unlock(&combM);
 }
 
-void addAcc(int accN, int balance) { // add a new account into accounts
-    accounts = realloc(accounts, (num_accounts + 1) * sizeof(struct BankAccount)); // reallocate memory
-    if (accounts == NULL) { // if allocation failed
-        fprintf(stderr, "Error adding an account.\n");
-        return;
+void lockW(int idx) { // put a write lock
+    pthread_rwlock_t *lock = &ACCLOCK(idx).lock;
+    int ret = pthread_rwlock_trywrlock(lock);
+    if (ret == EBUSY && __atomic_add_fetch(&ACCLOCK(idx).contended, 1, __ATOMIC_RELAXED) == HOTLIMIT) {
+        makeHot(idx); // this account keeps getting fought over, later deposits and withdrawals get combined
     }
-    num_accounts++; // update number of accounts
-    accounts[num_accounts - 1].accountN = accN; // save account details
-    accounts[num_accounts - 1].balance = balance;
-    assert((pthread_rwlock_init(&accounts[num_accounts - 1].lock, NULL)) == 0);
-    saveAccDetails();
+    while (ret == EBUSY) { // while a lock exists, try again
+        ret = pthread_rwlock_trywrlock(lock);
+    }
+    assert(ret == 0);
 }
 
-void initAcc() { // initalize accounts
-    accounts = (struct BankAccount*)malloc(sizeof(struct BankAccount)); // allocate memory
-    if (accounts == NULL) { // if memory allocation failed
-        fprintf(stderr, "Error initializing the accounts.\n");
-        return;
+void unlock(int idx) { // unlock an account
+    assert((pthread_rwlock_unlock(&ACCLOCK(idx).lock)) == 0);
+}
+
+int apply(int idx, char op, long long amount) { // carry out a deposit or withdrawal on a locked account, returns one of the RES_ values
+    if (op == 'd') {
+        return acc_add(idx, amount) == 0 ? RES_OK : RES_OVERFLOW;
     }
-    num_accounts = 0;
-    int acc, amount;
-    FILE *file = fopen("account_details.txt", "r"); // check for previous account data
-    if (file == NULL) { // treat as file doesn't exist, even though there could just be an opening problem
-        return;
-    } else {
-        while (!feof(file)) { // while we haven't reached the end of the file
-            int f;
-            assert((f = fscanf(file, "%d - %d\n", &acc, &amount)) != 0); // write the scanned values into variables
-            addAcc(acc, amount); // add each found pre-existing account
+    return acc_withdraw(idx, amount);
+}
+
+int transfer(int from, int to, long long amount) { // move money between two accounts, returns 1 on success, -1 on overflow
+    int first = from < to ? from : to; // always lock in slot order, so two opposite transfers can't wait for each other
+    int second = from < to ? to : from;
+    long long t = trace_begin();
+    lockW(first);
+    if (first != second) { // so that we dont try to lock the same account twice, causing a forever loop
+        lockW(second);
+    }
+    trace_end(SPAN_LOCKWAIT, t);
+    t = trace_begin();
+    int ret = acc_transfer(from, to, amount);
+    trace_end(SPAN_APPLY, t);
+    unlock(first);
+    if (first != second) {
+        unlock(second);
+    }
+    return ret;
+}
+
+int combine(int idx, char op, long long amount) { // post an operation to a hot account's combiner and wait for it to be applied
+    struct Combiner *c = &combiners[ACCLOCK(idx).comb];
+    struct CombSlot *mine = &c->slot[desk - thread_data];
+    long long t = trace_begin(); // the whole wait counts, whoever ends up applying the operation
+    mine->amount = amount;
+    __atomic_store_n(&mine->op, op, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&mine->op, __ATOMIC_ACQUIRE) != 0) { // until some combiner has done our operation
+        if (pthread_rwlock_trywrlock(&ACCLOCK(idx).lock) == 0) { // we hold the account, apply every pending operation
+            int i, n = 0;
+            for (i = 0; i < MAXTHREADS; i++) {
+                struct CombSlot *sl = &c->slot[i];
+                int o = __atomic_load_n(&sl->op, __ATOMIC_ACQUIRE);
+                if (o != 0) {
+                    sl->result = apply(idx, o, sl->amount);
+                    __atomic_store_n(&sl->op, 0, __ATOMIC_RELEASE);
+                    n++;
+                }
+            }
+            c->batches++;
+            c->applied += n;
+            unlock(idx);
+        } else {
+            sched_yield(); // the current combiner will most likely pick our operation up
         }
-        fclose(file);
     }
+    trace_end(SPAN_LOCKWAIT, t);
+    return mine->result;
 }
 
-void accCheck(int acc) { // check if an account exists and adds one if not
-    int counter = 0;
+int update(int idx, char op, long long amount) { // deposit or withdraw, combined if the account is hot, returns 1 on success
+    if (__atomic_load_n(&ACCLOCK(idx).comb, __ATOMIC_ACQUIRE) >= 0 && desk != &mainWorker) {
+        return combine(idx, op, amount);
+    }
+    long long t = trace_begin();
+    lockW(idx);
+    trace_end(SPAN_LOCKWAIT, t);
+    t = trace_begin();
+    int ret = apply(idx, op, amount);
+    trace_end(SPAN_APPLY, t);
+    unlock(idx);
+    return ret;
+}
+
+void bulk(struct Command *c) { // change every account in the command's range in one pass
+    int n = __atomic_load_n(&num_accounts, __ATOMIC_ACQUIRE); // accounts opened meanwhile come after the change
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long t = trace_begin();
     int i;
-    for (i = 0; i < num_accounts; ++i) { // for every account in accounts
-        if (accounts[i].accountN != acc) { // increment counter if such a account number wasn't found
-            counter++;
+    for (i = 0; i < n; i++) { // in slot order like transfers, so the whole range changes at one moment
+        int acc = ACCNUMBER(i);
+        if (acc >= c->acc1 && acc <= c->acc2) {
+            pthread_rwlock_wrlock(&ACCLOCK(i).lock);
         }
     }
-    if (counter == num_accounts) { // if counter matches num_accounts, no account had the checked account number
-        addAcc(acc, 0); // thus we can add a new one with a balance of 0
+    trace_end(SPAN_LOCKWAIT, t);
+    t = trace_begin();
+    c->changed = acc_bulk(n, c->acc1, c->acc2, c->cmd == 'i', c->amount, &c->skipped);
+    trace_end(SPAN_APPLY, t);
+    for (i = 0; i < n; i++) {
+        int acc = ACCNUMBER(i);
+        if (acc >= c->acc1 && acc <= c->acc2) {
+            unlock(i);
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    c->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 }
 
-int findAcc(int accN) { // finds the account index with the account number
-    int i;
-    for (i = 0; i < num_accounts; ++i) {
-        if (accounts[i].accountN == accN) { // if we found the right number
-            break;
+void savePending() { // rewrite the pending file, called with pendM held
+    char buf[MAXPENDING * SNAPLINE * 2];
+    int i, len = 0;
+    for (i = 0; i < numPending; i++) {
+        len += sprintf(buf + len, "%d %d %lld\n", pending[i].tx, ACCNUMBER(pending[i].slot), pending[i].amount);
+    }
+    if (pwrite(pendFd, buf, len, 0) != len || ftruncate(pendFd, len) != 0) {
+        fprintf(stderr, "Error writing the pending transactions file.\n");
+    }
+}
+
+void loadPending() { // pick up the sides a previous run had prepared
+    FILE *f = fopen(PENDINGFILE, "r");
+    if (f == NULL) {
+        return;
+    }
+    int tx, acc;
+    long long amount;
+    while (numPending < MAXPENDING && fscanf(f, "%d %d %lld", &tx, &acc, &amount) == 3) {
+        int slot = acc_get(acc);
+        if (slot >= 0 && acc_reserve(slot, amount < 0 ? -amount : amount) == 0) { // the room was kept when the run saved it
+            pending[numPending++] = (struct Pending) { tx, slot, amount };
+        } else {
+            fprintf(stderr, "Dropped prepared transaction %d on account %d.\n", tx, acc);
         }
     }
-    return i;
+    fclose(f);
 }
 
-void lockR(int accN) { // put a read lock
-    pthread_rwlock_t *lock = &accounts[findAcc(accN)].lock;
-    int ret = pthread_rwlock_tryrdlock(lock);
-    while (ret == EBUSY) { // while a lock exists, try again
-        ret = pthread_rwlock_tryrdlock(lock);
+int prepare(struct Command *c, int idx) { // first phase of a cross-node transfer, returns one of the RES_ values
+    // both sides keep room for the money to come in (the paying side for a refund), so the second phase cannot fail
+    if (c->amount == LLONG_MIN) {
+        return RES_OVERFLOW;
     }
-    assert(ret == 0);
+    long long amount = c->amount < 0 ? -c->amount : c->amount;
+    int ret = RES_OK, i;
+    pthread_mutex_lock(&pendM);
+    for (i = 0; i < numAborted && i < MAXPENDING && aborted[i] != c->acc2; i++);
+    if (i < numAborted && i < MAXPENDING) { // the router gave up on it already
+        ret = RES_NOTX;
+    } else if (numPending == MAXPENDING) {
+        ret = RES_PENDING;
+    } else {
+        lockW(idx);
+        if (c->amount < 0) { // the paying side takes the money off now, so nothing can spend it before the commit
+            ret = acc_withdraw(idx, amount);
+            if (ret == RES_OK) {
+                acc_reserve(idx, amount); // fits, the money was there a moment ago
+            }
+        } else if (acc_reserve(idx, amount) != 0) {
+            ret = RES_OVERFLOW;
+        }
+        unlock(idx);
+    }
+    if (ret == RES_OK) {
+        pending[numPending++] = (struct Pending) { c->acc2, idx, c->amount };
+        savePending();
+    }
+    pthread_mutex_unlock(&pendM);
+    return ret;
 }
 
-void lockW(int accN) { // put a write lock
-    pthread_rwlock_t *lock = &accounts[findAcc(accN)].lock;
-    int ret = pthread_rwlock_trywrlock(lock);
-    while (ret == EBUSY) { // while a lock exists, try again
-        ret = pthread_rwlock_trywrlock(lock);
+int finish(struct Command *c) { // second phase, 'c' commits and 'a' aborts a prepared side, returns one of the RES_ values
+    pthread_mutex_lock(&pendM);
+    int i;
+    for (i = 0; i < numPending && pending[i].tx != c->acc2; i++);
+    if (i == numPending) { // done already (a repeat after a lost reply), or never prepared
+        if (c->cmd == 'a') { // a prepare still on its way must not hold anything
+            aborted[numAborted++ % MAXPENDING] = c->acc2;
+        }
+        pthread_mutex_unlock(&pendM);
+        return RES_NOTX;
     }
-    assert(ret == 0);
+    struct Pending p = pending[i];
+    c->acc1 = ACCNUMBER(p.slot); // for the reply
+    c->amount = p.amount;
+    lockW(p.slot);
+    acc_release(p.slot, p.amount < 0 ? -p.amount : p.amount, (c->cmd == 'c') == (p.amount > 0)); // a commit credits the receiver, an abort refunds the payer
+    unlock(p.slot);
+    pending[i] = pending[--numPending];
+    savePending();
+    pthread_mutex_unlock(&pendM);
+    return RES_OK;
 }
 
-void unlock(int accN) { // unlock an account
-    assert((pthread_rwlock_unlock(&accounts[findAcc(accN)].lock)) == 0);
+void lockBucket(int b, int n) { // write lock every account of a bucket among the first n slots, in slot order
+    int i;
+    for (i = 0; i < n; i++) {
+        if (cmd_bucket(ACCNUMBER(i)) == b) {
+            pthread_rwlock_wrlock(&ACCLOCK(i).lock);
+        }
+    }
 }
 
-void handleTrans(char cmd, int acc1, int acc2, int amount, int client_socket) { // handle transactions
-    char response[MAX_LENGTH];
+void unlockBucket(int b, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (cmd_bucket(ACCNUMBER(i)) == b) {
+            unlock(i);
+        }
+    }
+}
 
-    int w;
-    switch (cmd) {
-        case 'l': // get balance of account acc1
-            accCheck(acc1); // always check that the account exists, if not, it is created
-            lockR(acc1);
-            sprintf(response, "ok: Balance of account %d: %d\n", acc1, accounts[findAcc(acc1)].balance); // move the response to the variable
-            assert((w = write(client_socket, response, strlen(response) + 1)) != -1); // respond
-            toLog(response, logM);
-            unlock(acc1);
-            break;
-        case 'w': // withdraw from account acc1
-            accCheck(acc1); // always check that the account exists, if not, it is created
-            lockW(acc1);
-            if (accounts[findAcc(acc1)].balance >= amount) { // if there is enough money
-                accounts[findAcc(acc1)].balance -= amount;
-                sprintf(response, "ok: Withdrew %d from account %d\n", amount, acc1);
-                assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-                toLog(response, logM);
-            } else { // not enough money
-                sprintf(response, "fail: Not enough money on account %d\n", acc1);
-                assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-                toLog(response, logM);
+int exportBucket(struct Command *c) { // move a bucket's money out into the bucket file, returns one of the RES_ values
+    char path[MAX_LENGTH];
+    sprintf(path, "../" BUCKETFILE, c->acc1); // nodes run in directories of their own under the cluster directory
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return RES_IO;
+    }
+    int n = __atomic_load_n(&num_accounts, __ATOMIC_ACQUIRE);
+    lockBucket(c->acc1, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        if (cmd_bucket(ACCNUMBER(i)) == c->acc1) {
+            fprintf(f, "%d - %lld\n", ACCNUMBER(i), ACCBALANCE(i));
+            c->changed++;
+        }
+    }
+    int ret = fclose(f) == 0 ? RES_OK : RES_IO;
+    if (ret == RES_OK) { // the accounts stay behind empty and marked, so bulk changes pass them by
+        for (i = 0; i < n; i++) {
+            if (cmd_bucket(ACCNUMBER(i)) == c->acc1) {
+                acc_add(i, -ACCBALANCE(i));
+                acc_setgone(i, 1);
             }
-            unlock(acc1);
-            break;
-        case 't': // transfer amount from acc1 to acc2
-            accCheck(acc1); // always check that the account exists, if not, it is created
-            accCheck(acc2); // always check that the account exists, if not, it is created
-            lockW(acc1);
-            if (acc1 != acc2) { // so that we dont try to lock the same account twice, causing a forever loop
-                lockW(acc2);
+        }
+    }
+    unlockBucket(c->acc1, n);
+    return ret;
+}
+
+int importBucket(struct Command *c) { // add the balances of a bucket file, all or nothing, returns one of the RES_ values
+    char path[MAX_LENGTH];
+    sprintf(path, "../" BUCKETFILE, c->acc1);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return RES_IO;
+    }
+    int ret = RES_OK, acc;
+    long long balance;
+    while (ret == RES_OK && fscanf(f, "%d - %lld", &acc, &balance) == 2) {
+        int idx = acc_get(acc);
+        if (idx < 0) {
+            ret = RES_FULL;
+        } else {
+            acc_setgone(idx, 0); // an account that once left this node comes back
+            if ((ret = update(idx, 'd', balance)) == RES_OK) {
+                c->changed++;
             }
-            if (accounts[findAcc(acc1)].balance >= amount) { // if there is enough money
-                accounts[findAcc(acc1)].balance -= amount;
-                accounts[findAcc(acc2)].balance += amount;
-                sprintf(response, "ok: Transferred %d from account %d to account %d\n", amount, acc1, acc2);
-                assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-                toLog(response, logM);
-            } else { // not enough money
-                sprintf(response, "fail: Not enough money on account %d\n", acc1);
-                assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-                toLog(response, logM);
+        }
+    }
+    if (ret != RES_OK) { // take back what went in before the failure, the failed account included
+        rewind(f);
+        int i;
+        for (i = 0; i <= c->changed && fscanf(f, "%d - %lld", &acc, &balance) == 2; i++) {
+            int idx = acc_find(acc);
+            if (idx < 0) {
+                continue;
             }
-            unlock(acc1);
-            if (acc1 != acc2) {
-                unlock(acc2);
+            if (i < c->changed) {
+                update(idx, 'd', -balance);
             }
-            break;
-        case 'd': // deposit to account acc1
-            accCheck(acc1); // always check that the account exists, if not, it is created
-            lockW(acc1);
-            accounts[findAcc(acc1)].balance += amount;
-            sprintf(response, "ok: Deposited %d to account %d\n", amount, acc1);
-            assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-            toLog(response, logM);
-            unlock(acc1);
-            break;
-        case 'q': // quit the desk
-            sprintf(response, "ok: Quit the desk\n");
-            assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-            toLog(response, logM);
-            break;
-        default:
-            sprintf(response, "fail: Invalid command\n");
-            assert((w = write(client_socket, response, strlen(response) + 1)) != -1);
-            toLog(response, logM);
-            break;
+            acc_setgone(idx, 1); // the bucket is still not ours
+        }
+        c->changed = 0;
     }
-
-    saveAccDetails(); // update the details after the transaction
+    fclose(f);
+    return ret;
 }
 
-void copydata(int from,int to) {
-  char buf[1024];
-  int amount;
-
-  while ((amount = read(from, buf, sizeof(buf))) > 0) {
-    assert((write(to, buf, amount) == amount));
-
-    char cmd = buf[0];
-    int acc1 = 0, acc2 = 0, amount = 0;
-    char *errMsg = "fail: Error in command\n";
-    int e;
-    buf[strcspn(buf, "\n")] = '\0'; // remove trailing newline
-
-    switch (cmd) { // scan the others
-        case 'l': // of form l acc1
-            if (sscanf(buf, "l %d", &acc1) == 1 && buf[1] == ' ') { // next char must be always space
-                handleTrans(cmd, acc1, acc2, amount, from);
-                break;
-            } else {
-                assert((e = write(from, errMsg, strlen(errMsg) + 1)) != -1);
+int handleTrans(struct Command *c, char *response, int admin) { // handle transactions, returns the response length
+    int result = RES_OK;
+    long long balance = 0;
+    int i1 = -1, i2 = -1; // account slots
+    if (!nodeMode && cmd_isnode(c->cmd)) { // a lone bank has no router to take them from
+        c->cmd = '?';
+    }
+    if (!nodeMode && !admin && cmd_isadmin(c->cmd)) { // a node gets them from its router, a lone bank only from operators
+        c->cmd = '?';
+    }
+    if (c->cmd == 'l' || c->cmd == 'w' || c->cmd == 't' || c->cmd == 'd' || c->cmd == 'p') {
+        long long t = trace_begin();
+        i1 = acc_get(c->acc1); // always check that the account exists, if not, it is created
+        i2 = c->cmd == 't' ? acc_get(c->acc2) : i1;
+        trace_end(SPAN_LOOKUP, t);
+        if (i1 < 0 || i2 < 0) {
+            result = RES_FULL;
+        }
+    }
+    if (result != RES_FULL) {
+        switch (c->cmd) {
+            case 'l': { // get balance of account acc1
+                long long t = trace_begin();
+                balance = acc_read(i1);
+                trace_end(SPAN_APPLY, t);
                 break;
             }
-        case 'w': // of form w acc1 amount
-            if (sscanf(buf, "w %d %d", &acc1, &amount) == 2 && buf[1] == ' ') { // next char must be always space
-                handleTrans(cmd, acc1, acc2, amount, from);
+            case 'w': // withdraw from account acc1
+            case 'd': // deposit to account acc1
+                result = update(i1, c->cmd, c->amount);
                 break;
-            } else {
-                assert((e = write(from, errMsg, strlen(errMsg) + 1)) != -1);
+            case 't': // transfer amount from acc1 to acc2
+                result = transfer(i1, i2, c->amount);
                 break;
-            }
-        case 't': // of form t acc1 acc2 amount
-            if (sscanf(buf, "t %d %d %d", &acc1, &acc2, &amount) == 3 && buf[1] == ' ') { // next char must be always space
-                handleTrans(cmd, acc1, acc2, amount, from);
+            case 'i': // interest or fee rate on a range of accounts
+            case 'f': // flat change of a range of accounts
+                bulk(c);
                 break;
-            } else {
-                assert((e = write(from, errMsg, strlen(errMsg) + 1)) != -1);
-                break; 
-            }
-        case 'd': // of form d acc1 amount
-            if (sscanf(buf, "d %d %d", &acc1, &amount) == 2 && buf[1] == ' ') { // next char must be always space
-                handleTrans(cmd, acc1, acc2, amount, from);
-                break; 
-            } else {
-                assert((e = write(from, errMsg, strlen(errMsg) + 1)) != -1);
-                break; 
-            }
-        case 'q': // of form q
-            if (strlen(buf) > 1) { // q must be the only letter
-                assert((e = write(from, errMsg, strlen(errMsg) + 1)) != -1);
+            case 'p': // prepare one side of a transfer between cluster nodes
+                result = prepare(c, i1);
                 break;
-            } else {
-                handleTrans(cmd, acc1, acc2, amount, from);
+            case 'c': // commit it
+            case 'a': // abort it
+                result = finish(c);
+                break;
+            case 'e': // give a bucket away to another node
+                result = exportBucket(c);
+                break;
+            case 'g': // take a bucket over from another node
+                result = importBucket(c);
+                break;
+        }
+    }
+    int len = cmd_reply(c, result, balance, response); // move the response to the variable
+    if (captureOn) { // before logging, so the capture sees when the accounts changed
+        capture_reply(response);
+    }
+
+    long long t = trace_begin();
+    toLog(response, &logM);
+    trace_end(SPAN_LOG, t);
+    if (result != RES_FULL) {
+        saveAccDetails(); // update the details after the transaction
+    }
+    return len;
+}
+
+int handleCmd(struct Session *s) { // parse the session's command line and carry it out, returns the response length
+    struct Command c;
+    trace_request(); // every command line is a request of its own
+    if (captureOn) {
+        capture_add(s->id, s->line);
+    }
+    long long t = trace_begin();
+    int ret = cmd_parse(s->line, &c);
+    trace_end(SPAN_PARSE, t);
+    if (ret == 0) {
+        return handleTrans(&c, s->response, s->admin);
+    }
+    memcpy(s->response, errMsg, sizeof(errMsg));
+    if (captureOn) {
+        capture_reply(errMsg);
+    }
+    return sizeof(errMsg) - 1;
+}
+
+void copydata(struct Session *s, int to) { // serve one client until it hangs up
+  int amount;
+  int len;
+
+  while ((amount = linebuf_readdata(&s->lb, s->fd)) > 0) {
+    assert((write(to, s->lb.buf + s->lb.end - amount, amount) == amount));
+
+    while (linebuf_copyline(&s->lb, s->line, MAX_LENGTH) >= 0) { // a single read can hold several commands
+      len = handleCmd(s);
+      long long t = trace_begin();
+      if (write(s->fd, s->response, len + 1) == -1) { // respond, the terminating null included; the client may have hung up
+        return;
+      }
+      trace_end(SPAN_REPLY, t);
+    }
+  }
+}
+
+int peerGone(int fd) { // check if the other end of a quiet socket has hung up
+    struct pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, 0) != 0; // clients send nothing over the socket after the handshake, anything here is a hangup
+}
+
+void shmdata(struct Session *s, char *rd) { // serve one client over a shared-memory channel
+    int fd;
+    struct shmchan *c = shmchan_create(&fd);
+    if (c == NULL) { // no channel, a ready without a descriptor makes the client stay on the socket
+        if (write(s->fd, rd, strlen(rd) + 1) != -1) {
+            copydata(s, STDOUT_FILENO);
+        }
+        return;
+    }
+    int sent = fd_send(s->fd, rd, strlen(rd) + 1, fd); // the client maps the same memory
+    close(fd);
+    if (sent == -1) { // gone before the channel got to it
+        shmchan_unmap(c);
+        return;
+    }
+    pthread_mutex_lock(&(desk->mutex));
+    desk->shm = c; // a drain wakes us up through it
+    pthread_mutex_unlock(&(desk->mutex));
+
+    int len;
+    while ((len = shmring_pop(&c->req, s->line, MAX_LENGTH - 1, &c->closed, PEERCHECK_MS)) != 0) {
+        if (__atomic_load_n(&desk->cut, __ATOMIC_ACQUIRE)) { // a busy client never leaves the ring idle, so look every time
+            break;
+        }
+        if (len == -1) { // nothing for a while
+            if (peerGone(s->fd)) {
                 break;
             }
-        default:
-            handleTrans(cmd, acc1, acc2, amount, from);
+            continue;
+        }
+        s->line[len] = '\0';
+        len = handleCmd(s);
+        long long t = trace_begin();
+        int stuck = 0;
+        while (!stuck && shmring_push(&c->resp, s->response, len + 1) == -1) { // the client hasn't read its earlier responses yet
+            int w = shmring_wait(&c->resp, &c->closed, PEERCHECK_MS);
+            stuck = w == 1 || __atomic_load_n(&desk->cut, __ATOMIC_ACQUIRE) || (w == -1 && peerGone(s->fd));
+        }
+        trace_end(SPAN_REPLY, t);
+        if (stuck) { // hung up, or the drain time is up, while we waited for room
             break;
+        }
     }
-  }
-  
-  assert(amount >= 0);
+    pthread_mutex_lock(&(desk->mutex));
+    desk->shm = NULL;
+    pthread_mutex_unlock(&(desk->mutex));
+    shmchan_unmap(c);
+}
+
+void countShed() { // one more client turned away
+    pthread_mutex_lock(&shedM);
+    shedCount++;
+    pthread_mutex_unlock(&shedM);
+}
+
+void shed(int client_socket) { // turn a client away right away instead of letting it wait
+    if (write(client_socket, busyMsg, strlen(busyMsg) + 1) == -1) { // it may have given up waiting already, it is turned away all the same
+        toLog("Shed a client that had hung up\n", &logM);
+    }
+    countShed();
+}
+
+long elapsedMs(struct timespec *since) { // milliseconds passed since the given moment
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+void expireQueue(struct ThreadData *data) { // give back the slots of clients that never came for them, called with the desk mutex held
+    while (data->qCount > 0 && elapsedMs(&data->queued[data->qHead]) > deadline) { // if one shows up after all, it is served uncounted
+        data->qHead = (data->qHead + 1) % QLEN;
+        data->qCount--;
+        data->qSize--;
+    }
+}
+
+int enqueue(struct ThreadData *data) { // reserve a queue slot on a desk, returns -1 if the desk is full
+    int ret = -1;
+    pthread_mutex_lock(&(data->mutex));
+    expireQueue(data);
+    if (data->qSize < QLEN) {
+        clock_gettime(CLOCK_MONOTONIC, &data->queued[(data->qHead + data->qCount) % QLEN]);
+        data->qCount++;
+        data->qSize++; // update the queue size
+        ret = 0;
+    }
+    pthread_mutex_unlock(&(data->mutex));
+    return ret;
+}
+
+int dequeue(struct ThreadData *data, struct timespec *since) { // take the oldest waiting session off the queue
+    // returns 1 if it missed its deadline, 0 if not, -1 if no slot was reserved for it
+    int expired = -1;
+    since->tv_sec = since->tv_nsec = 0;
+    pthread_mutex_lock(&(data->mutex));
+    if (data->qCount > 0) { // a client could also have connected without asking the main socket first
+        *since = data->queued[data->qHead]; // when the main socket handed the client over
+        expired = elapsedMs(since) > deadline;
+        data->qHead = (data->qHead + 1) % QLEN;
+        data->qCount--;
+    }
+    pthread_mutex_unlock(&(data->mutex));
+    return expired;
+}
+
+void leaveQueue(struct ThreadData *data) { // a session of the desk is over
+    pthread_mutex_lock(&(data->mutex));
+    if (data->qSize > 0) { // clients handed out by a previous process were never counted here
+        data->qSize--;
+    }
+    pthread_mutex_unlock(&(data->mutex));
 }
 
 int findSmallestQ() { // find the shortest queue's index
     int minIndex = 0;
-    int minQSize = thread_data[0].qSize;
+    int minQSize = QLEN + 1;
 
     int i;
-    for (i = 0; i < MAXTHREADS; ++i) {
+    for (i = 0; i < MAXTHREADS; ++i) { // reads are unlocked, enqueue() makes the final call
+        if (thread_data[i].qSize == QLEN) { // maybe full of clients that took a path and never came
+            pthread_mutex_lock(&(thread_data[i].mutex));
+            expireQueue(&thread_data[i]);
+            pthread_mutex_unlock(&(thread_data[i].mutex));
+        }
         if (thread_data[i].qSize < minQSize) {
             minIndex = i;
             minQSize = thread_data[i].qSize;
@@ -291,55 +674,655 @@ void *thread_routine(void *arg) {
     int client_socket;
     struct sockaddr_un client_addr; // client address
     socklen_t clen = sizeof(client_addr); // client length
+    desk = data;
+    trace_thread(data - thread_data);
+    capture_thread(data - thread_data);
 
     int connIsBank;
     while (1) { // start accepting connections
+        struct pollfd p[2] = { { data->id, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+        if (poll(p, 2, -1) == -1) {
+            continue;
+        }
+        if (p[1].revents) { // the bank is closing, clients still in the backlog are left to whoever takes over
+            break;
+        }
         client_socket = accept(data->id, (struct sockaddr*) &client_addr, &clen); // accept connections
+        if (client_socket == -1) { // the socket is shared with a process taking over, which got there first
+            continue;
+        }
+        pthread_mutex_lock(&(data->mutex));
+        data->active = client_socket; // from here on a drain can cut the session off, even before it sends its flag
+        pthread_mutex_unlock(&(data->mutex));
         int r = read(client_socket, &connIsBank, sizeof(int));
-        r = r;
-        if (connIsBank) {
-            break;
+        struct timespec since;
+        trace_request(); // the handoff is traced as a request of its own
+        int late = dequeue(data, &since);
+        if (late == 1 || r != sizeof(int)) { // waited past the deadline, or hung up or cut off before saying anything
+            if (r == sizeof(int)) { // the client is better off retrying later
+                shed(client_socket);
+            }
+            pthread_mutex_lock(&(data->mutex));
+            data->active = -1;
+            pthread_mutex_unlock(&(data->mutex));
+            close(client_socket);
+            if (late != -1) {
+                leaveQueue(data);
+            }
+            continue;
         }
 
+        struct Session *s = pool_get(&data->sessions);
+        assert(s != NULL);
+        s->fd = client_socket;
+        s->id = captureOn ? capture_session() : 0;
+        s->admin = (connIsBank & ADMINCLIENT) && fd_trusted(client_socket); // anyone else gets a plain session
+        linebuf_init(&s->lb, s->in, sizeof(s->in));
         char *rd = "ready\n";
-        assert((write(client_socket, rd, strlen(rd) + 1)) != -1); // tell the client that the desk is ready to serve
-        copydata(client_socket, STDOUT_FILENO); // copies to buf while the client hasn't quit with 'q'
-        close(client_socket); // close the connection
+        if (connIsBank & SHMCLIENT) { // same-host client that wants to skip the socket for commands
+            shmdata(s, rd);
+        } else {
+            if (write(client_socket, rd, strlen(rd) + 1) != -1) { // tell the client that the desk is ready to serve
+                if (traceReq != 0 && since.tv_sec != 0) { // from the main socket's accept until the desk is ready
+                    trace_span(SPAN_ACCEPT, trace_ns(&since));
+                }
+                copydata(s, STDOUT_FILENO); // copies to buf while the client hasn't quit with 'q'
+            }
+        }
         pthread_mutex_lock(&(data->mutex));
-        data->qSize--; // update queue size
+        data->active = -1; // cleared before closing, the number may be reused right away
         pthread_mutex_unlock(&(data->mutex));
+        close(client_socket); // close the connection
+        pool_put(&data->sessions, s);
+        if (late == 0) { // only a reserved slot is given back
+            leaveQueue(data);
+        }
     }
 
+    capture_flush();
     char l[19];
     sprintf(l, "Desk %d exiting\n", data->id);
-    toLog(l, logM);
+    toLog(l, &logM);
+    __atomic_sub_fetch(&desksOpen, 1, __ATOMIC_RELEASE);
     return NULL;
 }
 
-void createThreads() { // function that creates all (10) threads
+void initWorker(struct ThreadData *data) { // set up the memory a worker needs for serving requests
+    assert((arena_init(&data->arena, ARENASIZE)) == 0);
+    pool_init(&data->sessions, &data->arena, sizeof(struct Session));
+    data->snap = NULL;
+    data->snapSize = 0;
+    data->uring = NULL;
+}
+
+enum { OP_ACCEPT = 1, OP_FLAG, OP_RECV, OP_SEND, OP_CLOSE, OP_LOG, OP_CANCEL, OP_WAKE, OP_GRACE }; // kinds of io_uring requests, kept in the low bits of user_data
+#define OPMASK 15UL // sessions come from the arena, so their addresses leave these bits free
+
+struct UringDesk { // io_uring state of one desk
+    struct uring ring;
+    struct uringbufs bufs;
+    int open; // still accepting new sessions
+    int ops; // requests that will still produce a final completion
+    int live; // sessions not closed yet
+    struct Session *sessions; // the live sessions, to cut them off when the drain time is up
+    int graceArmed; // the drain timeout is pending
+    struct __kernel_timespec graceTs; // drain time, read by the kernel while the timeout is pending
+    int heldLen[NUMBUFS]; // data in each held buffer
+    int heldNext[NUMBUFS]; // next held buffer of the same session
+};
+
+struct io_uring_sqe *getSqe(struct UringDesk *ud, struct Session *s, int op) { // new request tagged with its session and kind
+    struct io_uring_sqe *sqe = uring_sqe(&ud->ring);
+    assert(sqe != NULL);
+    sqe->user_data = (unsigned long) s | op; // op fits in OPMASK
+    ud->ops++;
+    return sqe;
+}
+
+void armRecv(struct UringDesk *ud, struct Session *s) { // multishot receive into the provided buffers
+    struct io_uring_sqe *sqe = getSqe(ud, s, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ud->bufs.bgid;
+    s->recvArmed = 1;
+}
+
+void sendOut(struct UringDesk *ud, struct Session *s, int last) { // send the waiting responses, last closes the session right after
+    struct io_uring_sqe *sqe = getSqe(ud, s, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s->fd;
+    sqe->addr = (unsigned long) s->out;
+    sqe->len = s->outLen;
+    s->sending = s->outLen;
+    if (last) { // linked, the close only starts once the send is done
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = getSqe(ud, s, OP_CLOSE);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = s->fd;
+    }
+}
+
+void maybeClose(struct UringDesk *ud, struct Session *s) { // close a finished session once nothing of it is in flight
+    if (s->closing == 1 && !s->flagArmed && !s->recvArmed && !s->sending) {
+        struct io_uring_sqe *sqe = getSqe(ud, s, OP_CLOSE);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = s->fd;
+        s->closing = 2;
+    }
+}
+
+void endSession(struct UringDesk *ud, struct Session *s) { // stop reading from a session and close it
+    if (s->closing) {
+        return;
+    }
+    s->closing = 1;
+    while (s->held != -1) { // nobody will read what was held back
+        int bid = s->held;
+        s->held = bid == s->heldTail ? -1 : ud->heldNext[bid];
+        uringbufs_put(&ud->bufs, bid);
+    }
+    if (s->flagArmed || s->recvArmed) { // the close waits for the receive to end
+        struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long) s | (s->flagArmed ? OP_FLAG : OP_RECV);
+    }
+    maybeClose(ud, s);
+}
+
+void serveLines(struct UringDesk *ud, struct Session *s) { // answer every complete line that fits into the output buffer
+    while (s->outLen + MAX_LENGTH <= (int) sizeof(s->out) && linebuf_copyline(&s->lb, s->line, MAX_LENGTH) >= 0) {
+        int len = handleCmd(s);
+        long long t = trace_begin(); // only covers queueing the response, the send completes later
+        memcpy(s->out + s->outLen, s->response, len + 1); // responses end with a null, as on the POSIX path
+        s->outLen += len + 1;
+        trace_end(SPAN_REPLY, t);
+    }
+    if (!s->sending && s->outLen > 0) {
+        sendOut(ud, s, 0);
+    }
+}
+
+void stopAccepting(struct UringDesk *ud) { // the bank is closing, serve the sessions we have for at most the drain time
+    if (!ud->open) {
+        return;
+    }
+    ud->open = 0;
+    struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT;
+    if (ud->live > 0) {
+        ud->graceTs.tv_sec = grace / 1000;
+        ud->graceTs.tv_nsec = (grace % 1000) * 1000000LL;
+        sqe = getSqe(ud, NULL, OP_GRACE);
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long) &ud->graceTs;
+        sqe->len = 1;
+        ud->graceArmed = 1;
+    }
+}
+
+void gotFlag(struct UringDesk *ud, struct Session *s) { // first thing a connection sends is whether it is a client or the bank
+    struct ThreadData *data = desk;
+    char *msg = "ready\n"; // a shared-memory request gets a plain ready, the client then stays on the socket
+    int last = 0;
+    struct timespec since;
+    trace_request();
+    int late = dequeue(data, &since);
+    s->counted = late != -1;
+    s->admin = (s->flag & ADMINCLIENT) && fd_trusted(s->fd); // anyone else gets a plain session
+    if (late == 1) { // waited past the deadline
+        msg = busyMsg;
+        last = 1;
+        countShed();
+    } else if (traceReq != 0 && since.tv_sec != 0) { // the ready is only queued here, as with the other replies
+        trace_span(SPAN_ACCEPT, trace_ns(&since));
+    }
+    s->outLen = strlen(msg) + 1;
+    memcpy(s->out, msg, s->outLen);
+    if (last) {
+        s->closing = 2;
+    } else {
+        armRecv(ud, s);
+    }
+    sendOut(ud, s, last);
+}
+
+void holdData(struct UringDesk *ud, struct Session *s, unsigned short bid, int len) { // keep a buffer lb has no room for, and stop receiving more
+    ud->heldLen[bid] = len;
+    if (s->held == -1) {
+        s->held = bid;
+    } else {
+        ud->heldNext[s->heldTail] = bid;
+    }
+    s->heldTail = bid;
+    if (s->recvArmed && !s->paused) { // the rest waits in the socket, so the client blocks instead of being dropped
+        struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long) s | OP_RECV;
+    }
+    s->paused = 1;
+}
+
+void unhold(struct UringDesk *ud, struct Session *s) { // move held buffers into lb as it empties, receive again once all are in
+    while (s->held != -1 && ud->heldLen[s->held] <= s->lb.size - s->lb.end) {
+        int bid = s->held;
+        s->held = bid == s->heldTail ? -1 : ud->heldNext[bid];
+        memcpy(s->lb.buf + s->lb.end, uringbufs_get(&ud->bufs, bid), ud->heldLen[bid]);
+        s->lb.end += ud->heldLen[bid];
+        uringbufs_put(&ud->bufs, bid);
+        serveLines(ud, s);
+    }
+    if (s->held != -1 && memchr(s->lb.buf, '\n', s->lb.end) == NULL) { // lb is full of a line that never ends, drop the client
+        endSession(ud, s);
+    } else if (s->held == -1 && s->paused && !s->recvArmed) {
+        s->paused = 0;
+        armRecv(ud, s);
+    }
+}
+
+void gotData(struct UringDesk *ud, struct Session *s, unsigned short bid, int len) { // data from a client, queued up as lines
+    if (s->closing) {
+        uringbufs_put(&ud->bufs, bid);
+        return;
+    }
+    if (s->held != -1 || len > s->lb.size - s->lb.end) { // the client is ahead of its answers
+        holdData(ud, s, bid, len);
+        return;
+    }
+    memcpy(s->lb.buf + s->lb.end, uringbufs_get(&ud->bufs, bid), len);
+    s->lb.end += len;
+    uringbufs_put(&ud->bufs, bid);
+    serveLines(ud, s);
+}
+
+void flushBatch(struct UringDesk *ud) { // persist what the last batch of completions changed
+    struct ThreadData *data = desk;
+    if (data->dirty) {
+        writeAccDetails(); // traced under the last request of the batch
+        data->dirty = 0;
+    }
+    if (!data->logBusy && data->logLen[data->logCur] > 0) { // one append for all lines logged since the last one
+        struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_LOG);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = logFd;
+        sqe->off = -1; // the log is opened with O_APPEND
+        sqe->addr = (unsigned long) data->logBuf[data->logCur];
+        sqe->len = data->logLen[data->logCur];
+        data->logBusy = 1;
+        data->logCur ^= 1;
+        data->logLen[data->logCur] = 0;
+    }
+}
+
+void complete(struct UringDesk *ud, struct io_uring_cqe *cqe) { // handle one completion
+    struct ThreadData *data = desk;
+    int op = cqe->user_data & OPMASK;
+    struct Session *s = (struct Session *) (unsigned long) (cqe->user_data & ~OPMASK);
+    int more = cqe->flags & IORING_CQE_F_MORE; // a multishot request keeps going
+    if (!more) {
+        ud->ops--;
+    }
+
+    switch (op) {
+        case OP_ACCEPT:
+            if (cqe->res >= 0) {
+                s = pool_get(&data->sessions);
+                assert(s != NULL);
+                memset(s, 0, offsetof(struct Session, in));
+                memset(&s->flag, 0, sizeof(struct Session) - offsetof(struct Session, flag));
+                s->fd = cqe->res;
+                s->id = captureOn ? capture_session() : 0;
+                linebuf_init(&s->lb, s->in, sizeof(s->in));
+                s->held = -1;
+                s->prev = NULL;
+                s->next = ud->sessions;
+                if (ud->sessions != NULL) {
+                    ud->sessions->prev = s;
+                }
+                ud->sessions = s;
+                ud->live++;
+                struct io_uring_sqe *sqe = getSqe(ud, s, OP_FLAG);
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = s->fd;
+                sqe->addr = (unsigned long) &s->flag;
+                sqe->len = sizeof(int);
+                sqe->msg_flags = MSG_WAITALL;
+                s->flagArmed = 1;
+            }
+            if (!more && ud->open) { // the kernel stopped the multishot accept, start another
+                struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_ACCEPT);
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->fd = data->id;
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            }
+            break;
+        case OP_FLAG:
+            s->flagArmed = 0;
+            if (cqe->res == sizeof(int) && !s->closing) {
+                gotFlag(ud, s);
+            } else { // hung up, or cut off by the drain before it said anything
+                s->closing = 1;
+                maybeClose(ud, s);
+            }
+            break;
+        case OP_RECV:
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe->res > 0) {
+                    gotData(ud, s, bid, cqe->res);
+                } else {
+                    uringbufs_put(&ud->bufs, bid);
+                }
+            }
+            if (!more) {
+                s->recvArmed = 0;
+                if (s->paused && !s->closing && (cqe->res == -ECANCELED || cqe->res == -ENOBUFS)) { // stopped for backpressure
+                    unhold(ud, s);
+                } else if (cqe->res == -ENOBUFS && !s->closing) { // ran out of buffers, the data is still waiting in the socket
+                    armRecv(ud, s);
+                } else {
+                    endSession(ud, s); // the client hung up (or the receive was cancelled)
+                    maybeClose(ud, s);
+                }
+            }
+            break;
+        case OP_SEND:
+            s->sending = 0;
+            if (s->closing == 2) { // the linked close takes it from here
+                break;
+            }
+            if (cqe->res < 0) {
+                endSession(ud, s);
+                maybeClose(ud, s); // it may have been closing already
+                break;
+            }
+            s->outLen -= cqe->res;
+            memmove(s->out, s->out + cqe->res, s->outLen);
+            if (!s->closing) {
+                serveLines(ud, s);
+                unhold(ud, s);
+            }
+            if (s->closing == 1 && s->outLen > 0 && !s->sending) { // finish answering before closing
+                sendOut(ud, s, 0);
+            }
+            maybeClose(ud, s);
+            break;
+        case OP_CLOSE:
+            if (cqe->res == -ECANCELED) { // the send before it failed, so the link was broken
+                s->closing = 1;
+                maybeClose(ud, s);
+                break;
+            }
+            if (s->counted) {
+                leaveQueue(data);
+            }
+            if (s->prev != NULL) {
+                s->prev->next = s->next;
+            } else {
+                ud->sessions = s->next;
+            }
+            if (s->next != NULL) {
+                s->next->prev = s->prev;
+            }
+            pool_put(&data->sessions, s);
+            ud->live--;
+            if (ud->live == 0 && ud->graceArmed) { // drained in time, don't wait for the timeout
+                struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_CANCEL);
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->addr = OP_GRACE;
+                ud->graceArmed = 0;
+            }
+            break;
+        case OP_LOG:
+            data->logBusy = 0;
+            break;
+        case OP_WAKE:
+            stopAccepting(ud);
+            break;
+        case OP_GRACE:
+            if (ud->graceArmed) { // time is up, close whatever is still open
+                ud->graceArmed = 0;
+                for (s = ud->sessions; s != NULL; s = s->next) {
+                    endSession(ud, s);
+                    if (s->sending && s->closing == 1) { // a client that stopped reading would hold the send forever
+                        struct io_uring_sqe *sqe = getSqe(ud, NULL, OP_CANCEL);
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = (unsigned long) s | OP_SEND;
+                    }
+                }
+            }
+            break;
+        default: // cancel results need nothing
+            break;
+    }
+}
+
+void *uring_routine(void *arg) { // desk that serves all of its sessions at once on an io_uring
+    struct ThreadData *data = (struct ThreadData*) arg; // the thread data object (desk)
+    struct UringDesk ud;
+    desk = data;
+    trace_thread(data - thread_data);
+    capture_thread(data - thread_data);
+    if (uring_init(&ud.ring, URINGSIZE) != 0) { // no io_uring here, do it the POSIX way
+        return thread_routine(arg);
+    }
+    if (uringbufs_init(&ud.ring, &ud.bufs, 0, NUMBUFS, SESSIONBUF) != 0) {
+        uring_exit(&ud.ring);
+        return thread_routine(arg);
+    }
+    data->logBuf[0] = arena_alloc(&data->arena, LOGBUF + 1); // room for a null when flushing at exit
+    data->logBuf[1] = arena_alloc(&data->arena, LOGBUF + 1);
+    assert(data->logBuf[0] != NULL && data->logBuf[1] != NULL);
+    data->logLen[0] = data->logLen[1] = 0;
+    data->logCur = 0;
+    data->logBusy = 0;
+    data->dirty = 0;
+    data->uring = &ud.ring;
+    ud.open = 1;
+    ud.ops = 0;
+    ud.live = 0;
+    ud.sessions = NULL;
+    ud.graceArmed = 0;
+
+    struct io_uring_sqe *sqe = getSqe(&ud, NULL, OP_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = data->id;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe = getSqe(&ud, NULL, OP_WAKE); // completes once the bank starts closing
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakeFd;
+    sqe->poll32_events = POLLIN;
+
+    while (ud.open || ud.live > 0 || ud.ops > 0) {
+        assert((uring_submit(&ud.ring, 1)) >= 0 || errno == EINTR); // one system call submits the batch and waits for the next
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&ud.ring)) != NULL) {
+            complete(&ud, cqe);
+            uring_seen(&ud.ring);
+        }
+        flushBatch(&ud);
+    }
+
+    data->uring = NULL; // from here on toLog() writes directly
+    if (data->logLen[data->logCur] > 0) {
+        data->logBuf[data->logCur][data->logLen[data->logCur]] = '\0';
+        toLog(data->logBuf[data->logCur], &logM);
+    }
+    uring_exit(&ud.ring);
+    uringbufs_free(&ud.bufs);
+
+    capture_flush();
+    char l[19];
+    sprintf(l, "Desk %d exiting\n", data->id);
+    toLog(l, &logM);
+    __atomic_sub_fetch(&desksOpen, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int listenOn(const char *path) { // bind a fresh listening socket, returns its descriptor
+    int fd;
+    assert((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+    unlink(path); // unlink any previous paths
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    assert((bind(fd, (struct sockaddr*) &addr, sizeof(addr))) != -1);
+    assert((listen(fd, QLEN)) != -1); // start listening with a queue size of 5 (QLEN)
+    return fd;
+}
+
+void initDesks(int *fds) { // set up the desks on their listening sockets, without starting them yet
     int i;
     for (i = 0; i < MAXTHREADS; ++i) {
         pthread_mutex_init(&(thread_data[i].mutex), NULL); // initalize every mutex
         thread_data[i].qSize = 0; // set the queue size
-        assert((thread_data[i].id = socket(AF_UNIX, SOCK_STREAM, 0)) != -1); // assign a UNIX socket
-        char path[14];
-        sprintf(path, "unix_socket_%d", i);
-        unlink(path); // unlink any previous paths
-        thread_data[i].path = path; // set the socket path
-
-        struct sockaddr_un server_addr; // server address
-        server_addr.sun_family = AF_UNIX; // initalize the address properties
-        sprintf(server_addr.sun_path, "unix_socket_%d", i);
-        socklen_t slen = sizeof(server_addr.sun_family) + strlen(server_addr.sun_path); // server length
+        thread_data[i].qHead = 0;
+        thread_data[i].qCount = 0;
+        thread_data[i].active = -1;
+        thread_data[i].shm = NULL;
+        thread_data[i].cut = 0;
+        initWorker(&thread_data[i]);
+        thread_data[i].id = fds[i];
+        sprintf(thread_data[i].path, "unix_socket_%d", i); // the path clients are sent to
+    }
+}
 
-        assert((bind(thread_data[i].id, (struct sockaddr*) &server_addr, slen)) != -1); // bind the socket
-        assert((listen(thread_data[i].id, QLEN)) != -1); // start listening with a queue size of 5 (QLEN)
-        assert((pthread_create(&threads[i], NULL, thread_routine, (void *) &thread_data[i])) == 0); // create the thread
+void createThreads() { // function that creates all (10) threads
+    sigset_t block, old; // signals are for the main thread, a desk in the middle of a read must not get them
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    desksOpen = MAXTHREADS;
+    int i;
+    for (i = 0; i < MAXTHREADS; ++i) {
+        assert((pthread_create(&threads[i], NULL, useUring ? uring_routine : thread_routine, (void *) &thread_data[i])) == 0); // create the thread
 
         char l[21];
         sprintf(l, "Desk %d is now open\n", i);
-        toLog(l, logM);
+        toLog(l, &logM);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    desksStarted = 1;
+}
+
+void captureSnapshot() { // put the accounts as they are now into the capture
+    int n = __atomic_load_n(&num_accounts, __ATOMIC_ACQUIRE);
+    char *snap = malloc(n * SNAPLINE + 1);
+    if (snap == NULL) {
+        fprintf(stderr, "Error capturing the account details.\n");
+        return;
+    }
+    capture_snapshot(snap, acc_format(snap, 0, n));
+    free(snap);
+}
+
+int openBank() { // load the accounts and start the desks, returns -1 on failure
+    acc_load("account_details.txt"); // figure out the accounts (if any pre-exist or not)
+    if (captureOn) { // what the captured commands start from
+        captureSnapshot();
+    }
+    accFd = open("account_details.txt", O_WRONLY | O_CREAT, 0644); // rewritten in place after every transaction
+    if (accFd == -1) {
+        fprintf(stderr, "Error opening the account details file.\n");
+        return -1;
+    }
+    if (nodeMode) {
+        loadPending();
+        pendFd = open(PENDINGFILE, O_WRONLY | O_CREAT, 0644);
+        if (pendFd == -1) {
+            fprintf(stderr, "Error opening the pending transactions file.\n");
+            return -1;
+        }
+    }
+    toLog("Accounts have been initalized\n", &logM);
+    createThreads(); // create all 10 desk threads
+    return 0;
+}
+
+void drainDesks() { // stop every desk at once, sessions still open after the drain time are cut off
+    if (!desksStarted) {
+        return;
+    }
+    uint64_t one = 1;
+    assert((write(wakeFd, &one, sizeof(one))) == sizeof(one)); // never read, so it stays readable for every desk
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct timespec nap = { 0, 5000000 };
+    while (__atomic_load_n(&desksOpen, __ATOMIC_ACQUIRE) > 0) {
+        if (elapsedMs(&start) >= grace) { // io_uring desks time out by themselves, the POSIX ones need a push
+            for (int i = 0; i < MAXTHREADS; i++) {
+                pthread_mutex_lock(&(thread_data[i].mutex));
+                __atomic_store_n(&thread_data[i].cut, 1, __ATOMIC_RELEASE);
+                if (thread_data[i].active != -1) {
+                    shutdown(thread_data[i].active, SHUT_RDWR); // the desk reads an end of file, or its blocked write fails, and finishes
+                }
+                if (thread_data[i].shm != NULL) { // or wakes up from the ring and sees cut
+                    shmchan_close(thread_data[i].shm);
+                }
+                pthread_mutex_unlock(&(thread_data[i].mutex));
+            }
+        }
+        nanosleep(&nap, NULL);
+    }
+    for (int i = 0; i < MAXTHREADS; i++) { // wait for threads to finish (sync up)
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int takeOver(int *fds) { // get the listening sockets of a running bank, returns the connection to it or -1
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, CTLPATH);
+    int s;
+    assert((s = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+    int req = HANDOVER;
+    if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1 || write(s, &req, sizeof(int)) != sizeof(int)) {
+        close(s);
+        return -1;
+    }
+    int i, idx;
+    for (i = 0; i < NUMLISTENERS; i++) { // sent in order, each with its index
+        if (fd_recv(s, &idx, sizeof(int), &fds[i]) != sizeof(int) || idx != i || fds[i] == -1) {
+            while (i >= 0) {
+                if (fds[i] != -1) {
+                    close(fds[i]);
+                }
+                i--;
+            }
+            close(s);
+            return -1;
+        }
+    }
+    return s;
+}
+
+int handOver(int ctl, int *fds) { // answer a control request, returns 1 if another process now owns our sockets
+    int conn = accept(ctl, NULL, NULL);
+    if (conn == -1) {
+        return 0;
+    }
+    int req = 0;
+    struct timeval tv = { 1, 0 }; // a stuck peer must not hold up the main socket
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (read(conn, &req, sizeof(int)) != sizeof(int) || req != HANDOVER || !desksStarted) {
+        close(conn);
+        return 0;
     }
+    int i;
+    for (i = 0; i < NUMLISTENERS; i++) {
+        if (fd_send(conn, &i, sizeof(int), fds[i]) != sizeof(int)) { // the new process gives up without all of them
+            close(conn);
+            return 0;
+        }
+    }
+    successor = conn;
+    return 1;
 }
 
 void sigHandler(int sig) { // to handle receiving a SIGINT or SIGTERM
@@ -350,9 +1333,46 @@ void sigHandler(int sig) { // to handle receiving a SIGINT or SIGTERM
 
 //main function which creates threads and assigns them a thread routine function goes under here...
 int main(int argc, char **argv) { // main server starter function
+    int opt;
+    int every = 0;
+    int restart = 0;
+    char *capturePath = NULL;
+    while ((opt = getopt(argc, argv, "d:ut:g:rc:n")) != -1) {
+        switch (opt) {
+            case 'd': deadline = atoi(optarg); break; // queue deadline in milliseconds
+            case 'u': useUring = 1; break; // io_uring backend for the desks
+            case 't': every = atoi(optarg); break; // trace one request in this many
+            case 'g': grace = atoi(optarg); break; // drain time in milliseconds
+            case 'r': restart = 1; break; // take over from a running bank
+            case 'c': capturePath = optarg; break; // record incoming commands for replay3
+            case 'n': nodeMode = 1; break; // cluster node, started by router3
+            default:
+                fprintf(stderr, "Usage: %s [-d deadline_ms] [-u] [-t trace_every] [-g drain_ms] [-r] [-c capture_file] [-n]\n", argv[0]);
+                return -1;
+        }
+    }
+    if (every > 0 && trace_init(every, MAXTHREADS) != 0) { // a ring per desk, the main thread only hands clients over
+        fprintf(stderr, "Error allocating the trace buffers.\n");
+        return -1;
+    }
+    if (capturePath != NULL && capture_open(capturePath, MAXTHREADS) != 0) { // like tracing, only the desks see commands
+        fprintf(stderr, "Error opening the capture file.\n");
+        return -1;
+    }
+
     assert((pthread_mutex_init(&logM, NULL)) == 0);
-    FILE *fp = fopen("log.txt", "w"); // try to open or create a log file, starting a blank slate
-    if (fp == NULL) { // if failed
+    assert((pthread_mutex_init(&shedM, NULL)) == 0);
+    assert((pthread_mutex_init(&saveM, NULL)) == 0);
+    assert((pthread_mutex_init(&combM, NULL)) == 0);
+    assert((pthread_mutex_init(&pendM, NULL)) == 0);
+
+    int fds[NUMLISTENERS]; // main socket, control socket, desk sockets
+    int old = -1; // connection to the bank we take over from, until it has saved its accounts
+    if (restart && (old = takeOver(fds)) == -1) {
+        fprintf(stderr, "No running bank to take over from, starting a new one.\n");
+    }
+    logFd = open("log.txt", O_WRONLY | O_CREAT | O_APPEND | (old == -1 ? O_TRUNC : 0), 0644); // a new bank starts a blank slate, a take-over carries on
+    if (logFd == -1) { // if failed
         fprintf(stderr, "Error in opening or creating an empty log file.\n");
         return -1;
     }
@@ -363,73 +1383,135 @@ int main(int argc, char **argv) { // main server starter function
     signal.sa_handler = sigHandler;
     assert((sigaction(SIGINT, &signal, NULL)) == 0);
     assert((sigaction(SIGTERM, &signal, NULL)) == 0);
+    signal.sa_handler = SIG_IGN; // a client that hangs up must not take the bank with it, its write just fails
+    assert((sigaction(SIGPIPE, &signal, NULL)) == 0);
+    assert((wakeFd = eventfd(0, 0)) != -1);
 
-    unlink("unix_socket"); // unlink previous main socket
+    if (old == -1) { // nobody to take over from, bind everything anew
+        fds[0] = listenOn("unix_socket");
+        fds[1] = listenOn(CTLPATH);
+        for (int i = 0; i < MAXTHREADS; i++) {
+            char path[16];
+            sprintf(path, "unix_socket_%d", i);
+            fds[i + 2] = listenOn(path);
+        }
+    }
+    for (int i = 0; i < NUMLISTENERS; i++) { // shared with the other process during a hand-over, so nobody may block in accept
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
 
-    toLog("Bank is open\n", logM);
-    initAcc(); // figure out the accounts (if any pre-exist or not)
-    toLog("Accounts have been initalized\n", logM);
-    createThreads(); // create all 10 desk threads + sockets
+    toLog(old == -1 ? "Bank is open\n" : "Bank is taking over\n", &logM);
+    desk = &mainWorker;
+    initWorker(&mainWorker);
+    initDesks(fds + 2);
+    if (old == -1 && openBank() != 0) { // a take-over opens once the old bank has saved
+        return -1;
+    }
 
-    int main_socket, client_socket;
+    int client_socket;
     pthread_mutex_t main_mutex;
-    struct sockaddr_un main_addr, client_addr;
-
-    main_addr.sun_family = AF_UNIX; // main address setup    
-    sprintf(main_addr.sun_path, "unix_socket");
-    socklen_t mlen = sizeof(main_addr); // main address length
-
-    assert((main_socket = socket(AF_UNIX, SOCK_STREAM, 0)) != -1); // create main socket
-    assert((bind(main_socket, (struct sockaddr*) &main_addr, mlen)) != -1); // bind the main socket
-    assert((listen(main_socket, QLEN)) != -1); // start listening on the main socket
-
     pthread_mutex_init(&main_mutex, NULL); // initialize main mutex
-    socklen_t clen = sizeof(client_addr); // client length
 
-    while (1) {
-        client_socket = accept(main_socket, (struct sockaddr*) &client_addr, &clen); // accep client connection
-        if (!bankIsOpen) {
-            break;
+    while (bankIsOpen) { // clients are handed out from the start, during a take-over they wait at the desks
+        struct pollfd p[3] = { { fds[0], POLLIN, 0 }, { fds[1], POLLIN, 0 }, { old, POLLIN, 0 } };
+        if (poll(p, old == -1 ? 2 : 3, -1) == -1) { // interrupted, maybe by a signal that closes the bank
+            continue;
         }
-        if (client_socket == -1 && errno == EINTR) {
+        if (old != -1 && p[2].revents) { // the old bank is done (or gone), its accounts are on disk
+            close(old);
+            old = -1;
+            if (openBank() != 0) {
+                break;
+            }
+            toLog("Took over from the old bank\n", &logM);
+        }
+        if (p[1].revents && handOver(fds[1], fds)) {
             break;
         }
+        if (!p[0].revents) {
+            continue;
+        }
+        client_socket = accept(fds[0], NULL, NULL); // accep client connection
+        if (client_socket == -1) {
+            continue;
+        }
         pthread_mutex_lock(&main_mutex); // lock the mutex for exclusive access
         int qIdx = findSmallestQ(); // smallest queue's index
-        char *path = thread_data[qIdx].path; // smallest queue's path
-        assert((write(client_socket, path, strlen(path) + 1)) != -1); // forward the new socket path to the client
-        thread_data[qIdx].qSize++; // update the queue size
+        if (enqueue(&thread_data[qIdx]) == 0) {
+            char *path = thread_data[qIdx].path; // smallest queue's path
+            if (write(client_socket, path, strlen(path) + 1) == -1) { // forward the new socket path to the client
+                toLog("A client left before it got its desk\n", &logM); // its reservation runs out with the deadline
+            }
+        } else { // every desk is full, answer busy now rather than letting the client queue without bound
+            shed(client_socket);
+        }
         pthread_mutex_unlock(&main_mutex); // unlock the mutex
         close(client_socket);
     }
 
-    toLog("Main socket has been closed\n", logM);
-
-    for (int i = 0; i < MAXTHREADS; i++) { // wait for threads to finish (sync up)
-        struct sockaddr_un address; // desks are always waiting for a new connection, imply via the bank itself that they can shut down
-        int socketDesk;
-        assert((socketDesk = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
-        address.sun_family = AF_UNIX;
-        char path[14];
-        sprintf(path, "unix_socket_%d", i);
-        strcpy(address.sun_path, path);
-        socklen_t len = sizeof(address.sun_family) + strlen(address.sun_path);
-        connect(socketDesk, (struct sockaddr *) &address, len);
-
-        int isBank = 1;
-        assert((write(socketDesk, &isBank, sizeof(int))) != -1);
-
-        pthread_join(threads[i], NULL);
-        close(socketDesk);
+    toLog(successor == -1 ? "Main socket has been closed\n" : "Handing over to a new bank\n", &logM);
+    drainDesks();
+    toLog("All desks have been closed\n", &logM);
+    if (desksStarted) { // last word on the accounts, the new bank loads it
+        writeAccDetails();
+        if (captureOn) { // what a replay should end up with
+            captureSnapshot();
+        }
+    }
+    if (captureOn && capture_close() != 0) {
+        toLog("Error writing the capture file\n", &logM);
+    }
+    if (successor != -1) { // the new bank opens its desks once we hang up
+        close(successor);
+    }
+    if (old != -1) { // closed before the old bank was done, leave its files alone
+        close(old);
+    }
+    char l[MAX_LENGTH];
+    sprintf(l, "Shed %d clients\n", shedCount);
+    toLog(l, &logM);
+    for (int i = 0; i < num_comb; i++) { // how well combining batched the hot accounts
+        sprintf(l, "Combiner %d applied %d operations in %d batches\n", i, combiners[i].applied, combiners[i].batches);
+        toLog(l, &logM);
+    }
+    if (traceEvery > 0) { // every desk has stopped, the rings can be read
+        int n = trace_dump(TRACEFILE);
+        if (n >= 0) {
+            sprintf(l, "Wrote %d trace records\n", n);
+            toLog(l, &logM);
+        } else {
+            toLog("Error writing the trace file\n", &logM);
+        }
+        trace_free();
+    }
+    acc_free(); // don't forget to free the allocated accounts
+    if (pendFd != -1) {
+        close(pendFd);
+    }
+    if (accFd != -1) {
+        close(accFd);
     }
-    toLog("All desks have been closed\n", logM);
-    free(accounts); // don't forget to free the mallocced accounts
 
-    for (int i = 0; i < MAXTHREADS; i++) { // destroy all mutexes
+    for (int i = 0; i < MAXTHREADS; i++) { // destroy all mutexes and free the desks' memory
+        sprintf(l, "Desk %d grew its arena %d times\n", i, thread_data[i].arena.allocs);
+        toLog(l, &logM);
         pthread_mutex_destroy(&(thread_data[i].mutex));
+        arena_free(&thread_data[i].arena);
     }
+    for (int i = 0; i < NUMLISTENERS; i++) { // a new bank keeps its own copies
+        close(fds[i]);
+    }
+    close(wakeFd);
+    sprintf(l, "Main thread grew its arena %d times\n", mainWorker.arena.allocs);
+    toLog(l, &logM);
+    arena_free(&mainWorker.arena);
     pthread_mutex_destroy(&main_mutex);
-    toLog("Bank has been closed\n", logM);
+    pthread_mutex_destroy(&shedM);
+    pthread_mutex_destroy(&saveM);
+    pthread_mutex_destroy(&combM);
+    pthread_mutex_destroy(&pendM);
+    toLog("Bank has been closed\n", &logM);
     pthread_mutex_destroy(&logM);
+    close(logFd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,156 @@
+/**
+ * Shared-memory transport for clients on the same host.
+ * A memfd holds two single-producer/single-consumer rings of fixed-size
+ * records. The consumer spins briefly and then sleeps on a futex, so a
+ * wakeup system call is only paid when the other side has gone idle. A
+ * producer facing a full ring sleeps the same way until the consumer
+ * takes something out.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+#define SPINS 2000 // empty polls before going to sleep
+
+static int futex(unsigned *addr,int op,unsigned val,struct timespec *ts) {
+    return syscall(SYS_futex,addr,op,val,ts,NULL,0);
+}
+
+/**
+ * Create a new channel in a memfd and map it.
+ * \param fd Set to the memfd, to be passed to the other side.
+ * \return The mapped channel, NULL on failure. */
+struct shmchan *shmchan_create(int *fd) {
+    *fd = memfd_create("bankchan",MFD_CLOEXEC);
+    if (*fd == -1) return NULL;
+    if (ftruncate(*fd,sizeof(struct shmchan)) == -1) {
+        close(*fd);
+        return NULL;
+    }
+    struct shmchan *c = shmchan_map(*fd); // a fresh memfd is all zeroes, rings start empty
+    if (c == NULL) close(*fd);
+    return c;
+}
+
+/**
+ * Map a channel created by the other side.
+ * \param fd Descriptor of the channel's memfd.
+ * \return The mapped channel, NULL on failure. */
+struct shmchan *shmchan_map(int fd) {
+    void *p = mmap(NULL,sizeof(struct shmchan),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ * Unmap a channel.
+ * \param c Channel to unmap. */
+void shmchan_unmap(struct shmchan *c) {
+    munmap(c,sizeof(struct shmchan));
+}
+
+/**
+ * Tell the desk that the client is done, waking it up if it sleeps.
+ * \param c Channel to close. */
+void shmchan_close(struct shmchan *c) {
+    __atomic_store_n(&c->closed,1,__ATOMIC_SEQ_CST); // ordered before the sleep check
+    if (__atomic_load_n(&c->req.sleeping,__ATOMIC_SEQ_CST)) {
+        futex(&c->req.head,FUTEX_WAKE,1,NULL);
+    }
+    if (__atomic_load_n(&c->resp.waiting,__ATOMIC_SEQ_CST)) { // or waits for room for a response
+        futex(&c->resp.tail,FUTEX_WAKE,1,NULL);
+    }
+}
+
+/**
+ * Append a record to a ring.
+ * \param r Ring to push to (we must be its only producer).
+ * \param data Record contents.
+ * \param len Length of data, at most RECSIZE.
+ * \return 0 on success, -1 if the ring is full or the record too long. */
+int shmring_push(struct shmring *r,const char *data,int len) {
+    unsigned head = r->head;
+    if (len > RECSIZE) return -1;
+    if (head-__atomic_load_n(&r->tail,__ATOMIC_ACQUIRE) == RINGSLOTS) return -1;
+    struct shmrec *rec = &r->rec[head % RINGSLOTS];
+    memcpy(rec->data,data,len);
+    rec->len = len;
+    __atomic_store_n(&r->head,head+1,__ATOMIC_SEQ_CST); // publish, and order it before the sleep check
+    if (__atomic_load_n(&r->sleeping,__ATOMIC_SEQ_CST)) {
+        futex(&r->head,FUTEX_WAKE,1,NULL);
+    }
+    return 0;
+}
+
+/**
+ * Take the next record from a ring, waiting for one if needed.
+ * \param r Ring to pop from (we must be its only consumer).
+ * \param dst Where to copy the record.
+ * \param size Size of dst, the record is cut short if it doesn't fit.
+ * \param closed Flag that ends the wait when it turns nonzero, or NULL.
+ * \param timeoutms Longest time to sleep at once, 0 for no limit.
+ * \return Length of the record, never more than size, 0 if closed was set
+ * (or the other side wrote a negative length), -1 on timeout. */
+int shmring_pop(struct shmring *r,char *dst,int size,int *closed,int timeoutms) {
+    unsigned tail = r->tail;
+    int spins = 0;
+    while (__atomic_load_n(&r->head,__ATOMIC_ACQUIRE) == tail) { // empty
+        if (closed != NULL && __atomic_load_n(closed,__ATOMIC_ACQUIRE)) return 0;
+        if (++spins < SPINS) continue;
+        __atomic_store_n(&r->sleeping,1,__ATOMIC_SEQ_CST);
+        int ret = 0;
+        if (__atomic_load_n(&r->head,__ATOMIC_SEQ_CST) == tail &&
+            (closed == NULL || !__atomic_load_n(closed,__ATOMIC_SEQ_CST))) { // nothing arrived while we got ready to sleep
+            struct timespec ts = { timeoutms/1000,(timeoutms%1000)*1000000L };
+            ret = futex(&r->head,FUTEX_WAIT,tail,timeoutms > 0 ? &ts : NULL);
+        }
+        __atomic_store_n(&r->sleeping,0,__ATOMIC_RELAXED);
+        if (ret == -1 && errno == ETIMEDOUT) return -1;
+        spins = 0;
+    }
+    struct shmrec *rec = &r->rec[tail % RINGSLOTS];
+    int len = __atomic_load_n(&rec->len,__ATOMIC_RELAXED); // the other side can write it at any time, so read it once
+    if (size > RECSIZE) size = RECSIZE;
+    if (len < 0) len = 0; // reads as a hang-up
+    if (len > size) len = size;
+    memcpy(dst,rec->data,len);
+    __atomic_store_n(&r->tail,tail+1,__ATOMIC_SEQ_CST); // ordered before the check for a waiting producer
+    if (__atomic_load_n(&r->waiting,__ATOMIC_SEQ_CST)) {
+        futex(&r->tail,FUTEX_WAKE,1,NULL);
+    }
+    return len;
+}
+
+/**
+ * Wait for room in a full ring.
+ * \param r Ring we push to (we must be its only producer).
+ * \param closed Flag that ends the wait when it turns nonzero, or NULL.
+ * \param timeoutms Longest time to sleep at once, 0 for no limit.
+ * \return 0 when there is room, 1 if closed was set, -1 on timeout. */
+int shmring_wait(struct shmring *r,int *closed,int timeoutms) {
+    unsigned head = r->head;
+    int spins = 0;
+    while (1) {
+        unsigned tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+        if (head-tail != RINGSLOTS) return 0;
+        if (closed != NULL && __atomic_load_n(closed,__ATOMIC_ACQUIRE)) return 1;
+        if (++spins < SPINS) continue;
+        __atomic_store_n(&r->waiting,1,__ATOMIC_SEQ_CST);
+        int ret = 0;
+        if (__atomic_load_n(&r->tail,__ATOMIC_SEQ_CST) == tail &&
+            (closed == NULL || !__atomic_load_n(closed,__ATOMIC_SEQ_CST))) { // nothing was taken while we got ready to sleep
+            struct timespec ts = { timeoutms/1000,(timeoutms%1000)*1000000L };
+            ret = futex(&r->tail,FUTEX_WAIT,tail,timeoutms > 0 ? &ts : NULL);
+        }
+        __atomic_store_n(&r->waiting,0,__ATOMIC_RELAXED);
+        if (ret == -1 && errno == ETIMEDOUT) return -1;
+        spins = 0;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#define RINGSLOTS 64 // records per ring, a power of two
+#define RECSIZE 124  // payload of one record
+
+struct shmrec {
+    int len;            // Bytes used in data.
+    char data[RECSIZE]; // One command or one response.
+};
+
+struct shmring { // single producer, single consumer
+    unsigned head __attribute__((aligned(64))); // Records pushed so far, also the futex word.
+    unsigned tail __attribute__((aligned(64))); // Records popped so far.
+    int sleeping;       // Consumer is (about to be) blocked in futex wait.
+    int waiting;        // Producer is (about to be) blocked on a full ring.
+    struct shmrec rec[RINGSLOTS] __attribute__((aligned(64)));
+};
+
+struct shmchan { // shared region between one client and one desk
+    struct shmring req;  // client -> desk
+    struct shmring resp; // desk -> client
+    int closed;          // client has hung up
+};
+
+struct shmchan *shmchan_create(int *fd);
+struct shmchan *shmchan_map(int fd);
+void shmchan_unmap(struct shmchan *c);
+void shmchan_close(struct shmchan *c);
+int shmring_push(struct shmring *r,const char *data,int len);
+int shmring_pop(struct shmring *r,char *dst,int size,int *closed,int timeoutms);
+int shmring_wait(struct shmring *r,int *closed,int timeoutms);
+
+#endif
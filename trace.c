@@ -0,0 +1,112 @@
+/**
+ * Sampled per-request tracing.
+ * Every thread records spans of the requests it serves into its own ring
+ * of fixed-size records, so tracing takes no locks. With tracing off a
+ * span costs one thread-local load and a branch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+int traceEvery = 0;                  // trace one request in this many, 0 is off
+_Thread_local unsigned traceReq = 0; // id of the request being traced on this thread, 0 if none
+static _Thread_local struct tracering *ring = NULL;
+static _Thread_local int thread = 0;
+static _Thread_local unsigned seen = 0; // requests started on this thread
+static struct tracering **rings = NULL;
+static int numrings = 0;
+
+const char *traceSpanName[NUMSPANS] = { "accept", "parse", "lookup", "lock wait", "apply", "persist", "log", "reply" };
+
+/**
+ * Turn tracing on.
+ * \param every Trace one request in this many.
+ * \param threads Number of threads that will call trace_thread().
+ * \return 0 on success, -1 on failure. */
+int trace_init(int every,int threads) {
+    rings = calloc(threads,sizeof(struct tracering *));
+    if (rings == NULL) return -1;
+    numrings = threads;
+    int i;
+    for (i = 0; i < threads; i++) {
+        rings[i] = calloc(1,sizeof(struct tracering));
+        if (rings[i] == NULL) {
+            trace_free();
+            return -1;
+        }
+    }
+    traceEvery = every;
+    return 0;
+}
+
+/**
+ * Attach the calling thread to its ring.
+ * \param t Thread number, less than the count given to trace_init(). */
+void trace_thread(int t) {
+    thread = t;
+    ring = t < numrings ? rings[t] : NULL;
+}
+
+/**
+ * Decide whether the request starting on this thread is traced. */
+void trace_sample(void) {
+    seen++;
+    if (ring != NULL && seen % traceEvery == 0) {
+        traceReq = (unsigned)(thread+1) << 24 | ((seen/traceEvery) & 0xffffff);
+        if (traceReq << 8 == 0) traceReq++; // never hand out a zero request number
+    } else {
+        traceReq = 0;
+    }
+}
+
+/**
+ * Record a span of the current request ending now.
+ * \param span One of the SPAN_ values.
+ * \param start Start of the span. */
+void trace_span(int span,long long start) {
+    if (ring == NULL) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    struct tracerec *r = &ring->rec[ring->n++ & (TRACERING-1)];
+    r->start = start;
+    r->dur = trace_ns(&ts)-start;
+    r->req = traceReq;
+    r->span = span;
+}
+
+/**
+ * Write every ring to a file. The threads must have stopped recording.
+ * \param path Dump file.
+ * \return Number of records written, -1 on failure. */
+int trace_dump(const char *path) {
+    FILE *f = fopen(path,"wb");
+    if (f == NULL) return -1;
+    struct tracehdr h = { TRACEMAGIC, numrings };
+    int total = 0,i;
+    fwrite(&h,sizeof(h),1,f);
+    for (i = 0; i < numrings; i++) {
+        struct tracering *r = rings[i];
+        int count = r->n < TRACERING ? (int)r->n : TRACERING;
+        int first = (r->n-count) & (TRACERING-1);
+        fwrite(&i,sizeof(int),1,f);
+        fwrite(&count,sizeof(int),1,f);
+        fwrite(&r->rec[first],sizeof(struct tracerec),count < TRACERING-first ? count : TRACERING-first,f);
+        if (count > TRACERING-first) fwrite(r->rec,sizeof(struct tracerec),count-(TRACERING-first),f);
+        total += count;
+    }
+    if (fclose(f) != 0) return -1;
+    return total;
+}
+
+/**
+ * Free the rings. */
+void trace_free(void) {
+    int i;
+    for (i = 0; i < numrings; i++) free(rings[i]);
+    free(rings);
+    rings = NULL;
+    numrings = 0;
+    traceEvery = 0;
+}
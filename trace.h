@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+#define TRACERING (1 << 16) // records per thread, a power of two, older ones get overwritten
+#define TRACEMAGIC 0x43525442 // "BTRC" at the start of a dump
+
+enum { SPAN_ACCEPT, SPAN_PARSE, SPAN_LOOKUP, SPAN_LOCKWAIT, SPAN_APPLY, SPAN_PERSIST, SPAN_LOG, SPAN_REPLY, NUMSPANS };
+
+struct tracerec {
+    long long start; // Nanoseconds on the monotonic clock.
+    int dur;         // Nanoseconds.
+    unsigned req;    // Request id, the thread in the top byte.
+    int span;        // One of the SPAN_ values.
+};
+
+struct tracering { // written only by its own thread
+    unsigned long long n; // Records written so far.
+    struct tracerec rec[TRACERING];
+};
+
+struct tracehdr { // dump file: this, then per thread its number, record count and records, oldest first
+    int magic;
+    int threads;
+};
+
+extern int traceEvery;
+extern _Thread_local unsigned traceReq;
+extern const char *traceSpanName[NUMSPANS];
+
+int trace_init(int every,int threads);
+void trace_thread(int thread);
+void trace_sample(void);
+void trace_span(int span,long long start);
+int trace_dump(const char *path);
+void trace_free(void);
+
+static inline long long trace_ns(const struct timespec *ts) {
+    return ts->tv_sec*1000000000LL+ts->tv_nsec;
+}
+
+/**
+ * Start a new request on this thread, sampled one in traceEvery. */
+static inline void trace_request(void) {
+    if (traceEvery > 0) trace_sample();
+}
+
+/**
+ * Start of a span.
+ * \return Current time, 0 if this request is not traced. */
+static inline long long trace_begin(void) {
+    if (traceReq == 0) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return trace_ns(&ts);
+}
+
+/**
+ * End of a span started with trace_begin().
+ * \param span One of the SPAN_ values.
+ * \param start What trace_begin() returned. */
+static inline void trace_end(int span,long long start) {
+    if (start != 0) trace_span(span,start);
+}
+
+#endif
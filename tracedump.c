@@ -0,0 +1,65 @@
+/*
+ * Turn a trace dump of server3 -t into Chrome trace JSON, for
+ * chrome://tracing or ui.perfetto.dev. Every desk is a thread of its own,
+ * every span carries its request id.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+/**
+ * Main function.
+ * \param argc Argument count.
+ * \param argv Argument table.
+ * \return 0 on success. */
+int main(int argc,char **argv) {
+    char *in = argc > 1 ? argv[1] : "trace.bin";
+    FILE *f = fopen(in,"rb");
+    if (f == NULL) {
+        fprintf(stderr,"Cannot open %s\n",in);
+        return -1;
+    }
+    FILE *out = stdout;
+    if (argc > 2 && (out = fopen(argv[2],"w")) == NULL) {
+        fprintf(stderr,"Cannot write %s\n",argv[2]);
+        return -1;
+    }
+    struct tracehdr h;
+    if (fread(&h,sizeof(h),1,f) != 1 || h.magic != TRACEMAGIC) {
+        fprintf(stderr,"%s is not a trace dump\n",in);
+        return -1;
+    }
+
+    // Times are shown relative to the earliest span
+    long pos = ftell(f);
+    long long base = -1;
+    int t,thread,count,i;
+    struct tracerec r;
+    for (t = 0; t < h.threads; t++) {
+        if (fread(&thread,sizeof(int),1,f) != 1 || fread(&count,sizeof(int),1,f) != 1) break;
+        for (i = 0; i < count && fread(&r,sizeof(r),1,f) == 1; i++) {
+            if (base == -1 || r.start < base) base = r.start;
+        }
+    }
+    fseek(f,pos,SEEK_SET);
+
+    int events = 0;
+    fprintf(out,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (t = 0; t < h.threads; t++) {
+        if (fread(&thread,sizeof(int),1,f) != 1 || fread(&count,sizeof(int),1,f) != 1) break;
+        fprintf(out,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"desk %d\"}}",events++ ? ",\n" : "",thread,thread);
+        for (i = 0; i < count && fread(&r,sizeof(r),1,f) == 1; i++) {
+            if (r.span < 0 || r.span >= NUMSPANS) continue;
+            fprintf(out,",\n{\"name\":\"%s\",\"cat\":\"bank\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"req\":\"%08x\"}}",
+                traceSpanName[r.span],thread,(r.start-base)/1000.0,r.dur/1000.0,r.req);
+            events++;
+        }
+    }
+    fprintf(out,"\n]}\n");
+    fclose(f);
+    if (out != stdout) fclose(out);
+    fprintf(stderr,"%d events\n",events-h.threads);
+    return 0;
+}
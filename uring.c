@@ -0,0 +1,185 @@
+/**
+ * Minimal io_uring wrapper on top of the raw system calls.
+ * Covers what the desks need: one ring per thread, submission and
+ * completion queue access, and a ring of provided receive buffers.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/**
+ * Set up a ring and map its queues.
+ * \param u Ring to set up.
+ * \param entries Submission queue size, a power of two.
+ * \return 0 on success, -1 if io_uring is not available. */
+int uring_init(struct uring *u,unsigned entries) {
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+    memset(u,0,sizeof(*u));
+    u->fd = syscall(SYS_io_uring_setup,entries,&p);
+    if (u->fd < 0) {
+        u->fd = -1;
+        return -1;
+    }
+    u->sqmapsize = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    u->cqmapsize = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) { // both queues live in one mapping
+        if (u->cqmapsize > u->sqmapsize) u->sqmapsize = u->cqmapsize;
+        u->cqmapsize = u->sqmapsize;
+    }
+    u->sqmap = mmap(NULL,u->sqmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQ_RING);
+    if (u->sqmap == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqmap = u->sqmap;
+    } else {
+        u->cqmap = mmap(NULL,u->cqmapsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_CQ_RING);
+        if (u->cqmap == MAP_FAILED) goto fail;
+    }
+    u->sqesize = p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL,u->sqesize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    char *sq = u->sqmap,*cq = u->cqmap;
+    u->sqhead = (unsigned *)(sq+p.sq_off.head);
+    u->sqtail = (unsigned *)(sq+p.sq_off.tail);
+    u->sqmask = (unsigned *)(sq+p.sq_off.ring_mask);
+    u->sqarray = (unsigned *)(sq+p.sq_off.array);
+    u->cqhead = (unsigned *)(cq+p.cq_off.head);
+    u->cqtail = (unsigned *)(cq+p.cq_off.tail);
+    u->cqmask = (unsigned *)(cq+p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq+p.cq_off.cqes);
+    return 0;
+fail:
+    uring_exit(u);
+    return -1;
+}
+
+/**
+ * Tear a ring down.
+ * \param u Ring to close. */
+void uring_exit(struct uring *u) {
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) munmap(u->sqes,u->sqesize);
+    if (u->cqmap != NULL && u->cqmap != MAP_FAILED && u->cqmap != u->sqmap) munmap(u->cqmap,u->cqmapsize);
+    if (u->sqmap != NULL && u->sqmap != MAP_FAILED) munmap(u->sqmap,u->sqmapsize);
+    if (u->fd >= 0) close(u->fd);
+    u->fd = -1;
+}
+
+/**
+ * Get a cleared submission entry, submitting queued ones if the queue is full.
+ * \param u Ring to take from.
+ * \return Entry to fill in, NULL if the queue stays full. */
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned tail = *u->sqtail+u->pending;
+    if (tail-__atomic_load_n(u->sqhead,__ATOMIC_ACQUIRE) > *u->sqmask) { // full, hand what we have to the kernel
+        if (uring_submit(u,0) < 0) return NULL;
+        tail = *u->sqtail;
+        if (tail-__atomic_load_n(u->sqhead,__ATOMIC_ACQUIRE) > *u->sqmask) return NULL;
+    }
+    unsigned idx = tail & *u->sqmask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    u->sqarray[idx] = idx;
+    u->pending++;
+    return sqe;
+}
+
+/**
+ * Submit prepared entries and optionally wait for completions.
+ * \param u Ring to submit on.
+ * \param wait Number of completions to wait for, 0 not to block.
+ * \return Number of entries submitted, -1 on error. */
+int uring_submit(struct uring *u,unsigned wait) {
+    unsigned n = u->pending;
+    __atomic_store_n(u->sqtail,*u->sqtail+n,__ATOMIC_RELEASE);
+    u->pending = 0;
+    int ret = syscall(SYS_io_uring_enter,u->fd,n,wait,wait > 0 ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    return ret;
+}
+
+/**
+ * Look at the oldest completion.
+ * \param u Ring to look at.
+ * \return The completion, or NULL if there is none. Mark it seen with uring_seen(). */
+struct io_uring_cqe *uring_cqe(struct uring *u) {
+    unsigned head = *u->cqhead;
+    if (head == __atomic_load_n(u->cqtail,__ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & *u->cqmask];
+}
+
+/**
+ * Release the completion returned by uring_cqe().
+ * \param u Ring it came from. */
+void uring_seen(struct uring *u) {
+    __atomic_store_n(u->cqhead,*u->cqhead+1,__ATOMIC_RELEASE);
+}
+
+/**
+ * Register a ring of receive buffers with the kernel.
+ * \param u Ring the buffers are for.
+ * \param b Buffer ring to set up.
+ * \param bgid Buffer group id.
+ * \param count Number of buffers, a power of two.
+ * \param size Size of every buffer.
+ * \return 0 on success, -1 on failure. */
+int uringbufs_init(struct uring *u,struct uringbufs *b,unsigned short bgid,unsigned count,unsigned size) {
+    b->count = count;
+    b->size = size;
+    b->bgid = bgid;
+    b->ring = mmap(NULL,count*sizeof(struct io_uring_buf),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (b->ring == MAP_FAILED) return -1;
+    b->mem = malloc((size_t)count*size);
+    if (b->mem == NULL) {
+        munmap(b->ring,count*sizeof(struct io_uring_buf));
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (unsigned long)b->ring;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if (syscall(SYS_io_uring_register,u->fd,IORING_REGISTER_PBUF_RING,&reg,1) != 0) {
+        uringbufs_free(b);
+        return -1;
+    }
+    b->ring->tail = 0;
+    unsigned short i;
+    for (i = 0; i < count; i++) uringbufs_put(b,i);
+    return 0;
+}
+
+/**
+ * Hand a buffer back to the kernel once its data has been used.
+ * \param b Buffer ring.
+ * \param bid Buffer id from the completion flags. */
+void uringbufs_put(struct uringbufs *b,unsigned short bid) {
+    unsigned short tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->count-1)];
+    buf->addr = (unsigned long)(b->mem+(size_t)bid*b->size);
+    buf->len = b->size;
+    buf->bid = bid;
+    __atomic_store_n(&b->ring->tail,tail+1,__ATOMIC_RELEASE);
+}
+
+/**
+ * Find the memory of a buffer the kernel filled.
+ * \param b Buffer ring.
+ * \param bid Buffer id from the completion flags.
+ * \return Start of the buffer. */
+char *uringbufs_get(struct uringbufs *b,unsigned short bid) {
+    return b->mem+(size_t)bid*b->size;
+}
+
+/**
+ * Free the buffer memory. The ring goes away with its io_uring.
+ * \param b Buffer ring. */
+void uringbufs_free(struct uringbufs *b) {
+    munmap(b->ring,b->count*sizeof(struct io_uring_buf));
+    free(b->mem);
+}
@@ -0,0 +1,37 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;                    // Ring descriptor, -1 if setup failed.
+    unsigned *sqhead,*sqtail,*sqmask,*sqarray;
+    struct io_uring_sqe *sqes; // Submission queue entries.
+    unsigned *cqhead,*cqtail,*cqmask;
+    struct io_uring_cqe *cqes; // Completion queue entries.
+    void *sqmap,*cqmap;        // Ring mappings (the same one with IORING_FEAT_SINGLE_MMAP).
+    size_t sqmapsize,cqmapsize,sqesize;
+    unsigned pending;          // Entries prepared but not submitted yet.
+};
+
+struct uringbufs { // ring of provided buffers, the kernel picks one per receive
+    struct io_uring_buf_ring *ring;
+    char *mem;                 // count buffers of size bytes each.
+    unsigned count,size;
+    unsigned short bgid;       // Buffer group id used in IOSQE_BUFFER_SELECT.
+};
+
+int uring_init(struct uring *u,unsigned entries);
+void uring_exit(struct uring *u);
+struct io_uring_sqe *uring_sqe(struct uring *u);
+int uring_submit(struct uring *u,unsigned wait);
+struct io_uring_cqe *uring_cqe(struct uring *u);
+void uring_seen(struct uring *u);
+
+int uringbufs_init(struct uring *u,struct uringbufs *b,unsigned short bgid,unsigned count,unsigned size);
+void uringbufs_put(struct uringbufs *b,unsigned short bid);
+char *uringbufs_get(struct uringbufs *b,unsigned short bid);
+void uringbufs_free(struct uringbufs *b);
+
+#endif